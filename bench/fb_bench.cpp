@@ -0,0 +1,524 @@
+// -*- C++ -*-
+
+//
+// Node based containers (list, map, set, unordered_map) with fb_alloc,
+// short_alloc/arena (plain, with free lists, small one spilling to operator new
+// and chained one growing from fb_alloc chunks) and std::allocator.
+//
+// Workloads:
+//    insert - fill empty container with N elements, then destroy it
+//    erase  - erase N elements of the filled container in random order
+//    churn  - container of N elements, erase random element and insert new one
+//    fifo   - container of N elements used as queue, erase the oldest and insert new one,
+//             allocation pattern of the producer/consumer pipeline
+//    batch  - fb_alloc alone, batches of N blocks taken and given back one by one
+//             or with allocate_n()/deallocate_n()
+//    teardown - map of N elements with fb_alloc dropped at the end of the request,
+//             destroyed node by node or with fb_scope at once
+//
+// Reported: items_per_second (throughput), p50_ns/p99_ns (latency of one operation,
+// measured over batches of ops_per_sample operations), rss_kb (resident set after
+// the run) and rss_delta_kb (growth of resident set during the run)
+//
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "fb_alloc.h"
+#include "fb_scope.h"
+#include "short_alloc.h"
+
+namespace
+{
+   const std::size_t arena_size     = 64*1024*1024;
+   const std::size_t small_size     = 64*1024;
+   const int         ops_per_sample = 64;
+
+   //
+   // allocator policies
+   //
+   struct std_policy
+   {
+      template <typename T> using alloc = std::allocator<T>;
+
+      template <typename T> static alloc<T> get( void ) { return alloc<T>(); }
+      static void reset( void ) {}
+   };
+
+   struct fb_policy
+   {
+      template <typename T> using alloc = fb_alloc<T>;
+
+      template <typename T> static alloc<T> get( void ) { return alloc<T>(); }
+      static void reset( void ) {}
+   };
+
+   struct short_policy
+   {
+      template <typename T> using alloc = short_alloc<T, arena_size>;
+
+      static arena<arena_size>& buffer( void )
+      {
+         static std::unique_ptr< arena<arena_size> > a( new arena<arena_size> );
+         return *a;
+      }
+
+      template <typename T> static alloc<T> get( void ) { return alloc<T>( buffer() ); }
+      static void reset( void ) { buffer().reset(); }
+   };
+
+   //
+   // arena which reuses blocks freed out of LIFO order
+   //
+   struct short_recycle_policy
+   {
+      static const std::size_t nof_classes = 8;
+
+      template <typename T> using alloc = short_alloc<T, arena_size, nof_classes>;
+
+      static arena<arena_size, nof_classes>& buffer( void )
+      {
+         static std::unique_ptr< arena<arena_size, nof_classes> > a( new arena<arena_size, nof_classes> );
+         return *a;
+      }
+
+      template <typename T> static alloc<T> get( void ) { return alloc<T>( buffer() ); }
+      static void reset( void ) { buffer().reset(); }
+   };
+
+   //
+   // small arena, everything past it goes to operator new one by one
+   //
+   struct short_spill_policy
+   {
+      template <typename T> using alloc = short_alloc<T, small_size>;
+
+      static arena<small_size>& buffer( void )
+      {
+         static std::unique_ptr< arena<small_size> > a( new arena<small_size> );
+         return *a;
+      }
+
+      template <typename T> static alloc<T> get( void ) { return alloc<T>( buffer() ); }
+      static void reset( void ) { buffer().reset(); }
+   };
+
+   //
+   // small arena chained to blocks taken from fb_alloc chunks
+   //
+   struct short_chained_policy
+   {
+      typedef fb_depot_upstream< fb_alloc<char> > upstream;
+
+      template <typename T> using alloc = short_alloc<T, small_size, 0, upstream>;
+
+      static arena<small_size, 0, upstream>& buffer( void )
+      {
+         static std::unique_ptr< arena<small_size, 0, upstream> > a( new arena<small_size, 0, upstream>( upstream::instance() ) );
+         return *a;
+      }
+
+      template <typename T> static alloc<T> get( void ) { return alloc<T>( buffer() ); }
+      static void reset( void ) { buffer().reset(); }
+   };
+
+   //
+   // containers, make() builds the empty one, insert() returns iterator to the new element
+   //
+   template <typename P> struct list_of
+   {
+      typedef std::list<int, typename P::template alloc<int> > type;
+
+      static type* make( std::size_t ) { return new type( P::template get<int>() ); }
+      static typename type::iterator insert( type& c, int k ) { return c.insert( c.end(), k ); }
+   };
+
+   template <typename P> struct map_of
+   {
+      typedef std::map<int, int, std::less<int>, typename P::template alloc< std::pair<const int,int> > > type;
+
+      static type* make( std::size_t ) { return new type( std::less<int>(), P::template get< std::pair<const int,int> >() ); }
+      static typename type::iterator insert( type& c, int k ) { return c.emplace( k, k ).first; }
+   };
+
+   template <typename P> struct set_of
+   {
+      typedef std::set<int, std::less<int>, typename P::template alloc<int> > type;
+
+      static type* make( std::size_t ) { return new type( std::less<int>(), P::template get<int>() ); }
+      static typename type::iterator insert( type& c, int k ) { return c.insert( k ).first; }
+   };
+
+   template <typename P> struct unordered_map_of
+   {
+      typedef std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                                 typename P::template alloc< std::pair<const int,int> > > type;
+
+      //
+      // buckets are reserved up front: no rehash, so stored iterators stay valid
+      //
+      static type* make( std::size_t n )
+      {
+         type* c = new type( 0, std::hash<int>(), std::equal_to<int>(), P::template get< std::pair<const int,int> >() );
+         c->reserve( n + 1 );
+         return c;
+      }
+      static typename type::iterator insert( type& c, int k ) { return c.emplace( k, k ).first; }
+   };
+
+   //
+   // unique keys in random order
+   //
+   class keys
+   {
+      public:
+
+         keys( void ) : n_( 0 ) {}
+
+         int next( void )
+         {
+            return static_cast<int>( (++n_ * 2654435761u) & 0x7fffffff );
+         }
+
+      private:
+
+         unsigned int n_;
+   };
+
+   long rss_kb( void )
+   {
+      long pages = 0;
+      long rss   = 0;
+      std::FILE* f = std::fopen( "/proc/self/statm", "r" );
+      if ( f != 0 )
+      {
+         if ( std::fscanf( f, "%ld %ld", &pages, &rss ) != 2 )
+         {
+            rss = 0;
+         }
+         std::fclose( f );
+      }
+      return rss * (sysconf(_SC_PAGESIZE) / 1024);
+   }
+
+   //
+   // per operation latency samples and resident set accounting
+   //
+   class probe
+   {
+      public:
+
+         probe( void ) : rss_( rss_kb() ) {}
+
+         void sample( std::chrono::steady_clock::time_point start, int nops )
+         {
+            std::chrono::nanoseconds dt = std::chrono::steady_clock::now() - start;
+            samples_.push_back( static_cast<double>( dt.count() )/nops );
+         }
+
+         void report( benchmark::State& state, std::size_t items )
+         {
+            state.SetItemsProcessed( static_cast<int64_t>(items) );
+            if ( !samples_.empty() )
+            {
+               std::sort( samples_.begin(), samples_.end() );
+               state.counters["p50_ns"] = samples_[ samples_.size()/2 ];
+               state.counters["p99_ns"] = samples_[ (samples_.size()*99)/100 ];
+            }
+            long rss = rss_kb();
+            state.counters["rss_kb"]       = static_cast<double>( rss );
+            state.counters["rss_delta_kb"] = static_cast<double>( rss - rss_ );
+         }
+
+      private:
+
+         long                rss_;
+         std::vector<double> samples_;
+   };
+
+   template <typename C> void bm_insert( benchmark::State& state )
+   {
+      std::size_t n = static_cast<std::size_t>( state.range(0) );
+      std::size_t items = 0;
+      probe       pr;
+      keys        ks;
+
+      for( auto _ : state )
+      {
+         {
+            std::unique_ptr<typename C::type> c( C::make( n ) );
+            for( std::size_t k = 0; k < n; k += ops_per_sample )
+            {
+               std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+               for( int j = 0; j != ops_per_sample; ++j )
+               {
+                  benchmark::DoNotOptimize( C::insert( *c, ks.next() ) );
+               }
+               pr.sample( t0, ops_per_sample );
+            }
+            items += n;
+         }
+         C::policy::reset();
+      }
+      pr.report( state, items );
+   }
+
+   template <typename C> void bm_erase( benchmark::State& state )
+   {
+      std::size_t n = static_cast<std::size_t>( state.range(0) );
+      std::size_t items = 0;
+      probe       pr;
+      keys        ks;
+      std::mt19937 rng( 12345 );
+
+      for( auto _ : state )
+      {
+         state.PauseTiming();
+         std::unique_ptr<typename C::type> c( C::make( n ) );
+         std::vector<typename C::type::iterator> its;
+         its.reserve( n );
+         for( std::size_t k = 0; k != n; ++k )
+         {
+            its.push_back( C::insert( *c, ks.next() ) );
+         }
+         std::shuffle( its.begin(), its.end(), rng );
+         state.ResumeTiming();
+
+         for( std::size_t k = 0; k < n; k += ops_per_sample )
+         {
+            std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            for( std::size_t j = k; j != k + ops_per_sample && j != n; ++j )
+            {
+               c->erase( its[j] );
+            }
+            pr.sample( t0, ops_per_sample );
+         }
+         items += n;
+
+         state.PauseTiming();
+         c.reset();
+         C::policy::reset();
+         state.ResumeTiming();
+      }
+      pr.report( state, items );
+   }
+
+   template <typename C> void bm_churn( benchmark::State& state )
+   {
+      std::size_t n = static_cast<std::size_t>( state.range(0) );
+      std::size_t items = 0;
+      probe       pr;
+      keys        ks;
+      std::mt19937 rng( 12345 );
+
+      {
+         std::unique_ptr<typename C::type> c( C::make( n ) );
+         std::vector<typename C::type::iterator> its;
+         its.reserve( n );
+         for( std::size_t k = 0; k != n; ++k )
+         {
+            its.push_back( C::insert( *c, ks.next() ) );
+         }
+
+         for( auto _ : state )
+         {
+            for( std::size_t k = 0; k < n; k += ops_per_sample )
+            {
+               std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+               for( int j = 0; j != ops_per_sample; ++j )
+               {
+                  std::size_t slot = rng() % n;
+                  c->erase( its[slot] );
+                  its[slot] = C::insert( *c, ks.next() );
+               }
+               pr.sample( t0, ops_per_sample );
+            }
+            items += n;
+         }
+         pr.report( state, items );
+      }
+      C::policy::reset();
+   }
+
+   template <typename C> void bm_fifo( benchmark::State& state )
+   {
+      std::size_t n = static_cast<std::size_t>( state.range(0) );
+      std::size_t items = 0;
+      probe       pr;
+      keys        ks;
+
+      {
+         std::unique_ptr<typename C::type> c( C::make( n ) );
+         std::deque<typename C::type::iterator> fifo;
+         for( std::size_t k = 0; k != n; ++k )
+         {
+            fifo.push_back( C::insert( *c, ks.next() ) );
+         }
+
+         for( auto _ : state )
+         {
+            for( std::size_t k = 0; k < n; k += ops_per_sample )
+            {
+               std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+               for( int j = 0; j != ops_per_sample; ++j )
+               {
+                  c->erase( fifo.front() );
+                  fifo.pop_front();
+                  fifo.push_back( C::insert( *c, ks.next() ) );
+               }
+               pr.sample( t0, ops_per_sample );
+            }
+            items += n;
+         }
+         pr.report( state, items );
+      }
+      C::policy::reset();
+   }
+
+   //
+   // batch producer/consumer stage: allocate batch of nodes, free it,
+   // element by element or with allocate_n()/deallocate_n()
+   //
+   struct message
+   {
+      char payload_[64];
+   };
+
+   template <bool batched> void bm_batch( benchmark::State& state )
+   {
+      std::size_t n = static_cast<std::size_t>( state.range(0) );
+      std::size_t items = 0;
+      probe       pr;
+
+      fb_alloc<message>     a;
+      std::vector<message*> batch( n );
+
+      for( auto _ : state )
+      {
+         std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+         for( int j = 0; j != ops_per_sample; ++j )
+         {
+            if ( batched )
+            {
+               a.allocate_n( &batch[0], n );
+               benchmark::DoNotOptimize( batch[0] );
+               a.deallocate_n( &batch[0], n );
+            }
+            else
+            {
+               for( std::size_t k = 0; k != n; ++k )
+               {
+                  batch[k] = a.allocate( 1 );
+               }
+               benchmark::DoNotOptimize( batch[0] );
+               for( std::size_t k = 0; k != n; ++k )
+               {
+                  a.deallocate( batch[k], 1 );
+               }
+            }
+         }
+         pr.sample( t0, static_cast<int>( ops_per_sample*n ) );
+         items += ops_per_sample*n;
+      }
+      pr.report( state, items );
+   }
+
+   //
+   // request lifetime map: filled while timing is paused, only its teardown
+   // is measured, one sample per teardown
+   //
+   template <bool scoped> void bm_teardown( benchmark::State& state )
+   {
+      typedef std::map<int, int, std::less<int>, fb_alloc< std::pair<const int,int> > > map_type;
+
+      std::size_t n = static_cast<std::size_t>( state.range(0) );
+      std::size_t items = 0;
+      probe       pr;
+      keys        ks;
+
+      for( auto _ : state )
+      {
+         state.PauseTiming();
+         fb_scope< fb_alloc<int> > scope;
+         std::unique_ptr<map_type> c;
+         map_type* m = 0;
+         if ( scoped )
+         {
+            m = &scope.make<map_type>();
+         }
+         else
+         {
+            c.reset( new map_type( std::less<int>(), fb_alloc< std::pair<const int,int> >() ) );
+            m = c.get();
+         }
+         for( std::size_t k = 0; k != n; ++k )
+         {
+            m->emplace( ks.next(), 0 );
+         }
+         state.ResumeTiming();
+
+         std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+         if ( scoped )
+         {
+            scope.reset();
+         }
+         else
+         {
+            c.reset();
+         }
+         pr.sample( t0, 1 );
+         items += n;
+      }
+      pr.report( state, items );
+   }
+
+   template <template <typename> class K, typename P> struct bench : K<P>
+   {
+      typedef P policy;
+   };
+}
+
+#define FB_BENCH_CONTAINER(K)                                                                             \
+   BENCHMARK_TEMPLATE( bm_insert, bench<K, std_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                 \
+   BENCHMARK_TEMPLATE( bm_insert, bench<K, fb_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                  \
+   BENCHMARK_TEMPLATE( bm_insert, bench<K, short_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );               \
+   BENCHMARK_TEMPLATE( bm_insert, bench<K, short_spill_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );         \
+   BENCHMARK_TEMPLATE( bm_insert, bench<K, short_chained_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );       \
+   BENCHMARK_TEMPLATE( bm_erase, bench<K, std_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                  \
+   BENCHMARK_TEMPLATE( bm_erase, bench<K, fb_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                   \
+   BENCHMARK_TEMPLATE( bm_erase, bench<K, short_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                \
+   BENCHMARK_TEMPLATE( bm_churn, bench<K, std_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                  \
+   BENCHMARK_TEMPLATE( bm_churn, bench<K, fb_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                   \
+   BENCHMARK_TEMPLATE( bm_churn, bench<K, short_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                \
+   BENCHMARK_TEMPLATE( bm_churn, bench<K, short_recycle_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );        \
+   BENCHMARK_TEMPLATE( bm_fifo, bench<K, std_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                   \
+   BENCHMARK_TEMPLATE( bm_fifo, bench<K, fb_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                    \
+   BENCHMARK_TEMPLATE( bm_fifo, bench<K, short_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 );                 \
+   BENCHMARK_TEMPLATE( bm_fifo, bench<K, short_recycle_policy> )->Arg( 1 << 12 )->Arg( 1 << 16 )
+
+FB_BENCH_CONTAINER( list_of );
+FB_BENCH_CONTAINER( map_of );
+FB_BENCH_CONTAINER( set_of );
+FB_BENCH_CONTAINER( unordered_map_of );
+
+BENCHMARK_TEMPLATE( bm_batch, false )->Arg( 32 )->Arg( 256 );
+BENCHMARK_TEMPLATE( bm_batch, true )->Arg( 32 )->Arg( 256 );
+
+BENCHMARK_TEMPLATE( bm_teardown, false )->Arg( 1 << 12 )->Arg( 1 << 16 );
+BENCHMARK_TEMPLATE( bm_teardown, true )->Arg( 1 << 12 )->Arg( 1 << 16 );
+
+BENCHMARK_MAIN();
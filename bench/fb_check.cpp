@@ -0,0 +1,214 @@
+// -*- C++ -*-
+
+//
+// Regression checks, run by ctest. Each failed check prints what failed,
+// exit code is nonzero if any of them did
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "fb_alloc.h"
+#include "fb_mmap_provider.h"
+#include "fb_resource.h"
+
+namespace
+{
+   int nof_failed = 0;
+
+   void check( bool ok, const char* what )
+   {
+      if ( !ok )
+      {
+         std::fprintf( stderr, "FAILED: %s\n", what );
+         ++nof_failed;
+      }
+   }
+
+   //
+   // chunks smaller than page given back to fb_mmap_provider must not drop
+   // the pages of their neighbours still in use
+   //
+   void check_mmap_trim_keeps_neighbours( void )
+   {
+      typedef fb_alloc<long> alloc;
+
+      static fb_mmap_provider provider( fb_mmap_provider::NO_HUGE_PAGES );
+      alloc::set_provider( &provider );
+      alloc::set_high_water_mark( 0 );
+
+      alloc dead;
+      long* q = dead.allocate( 1 ); // first chunk of the page, followed by live ones
+
+      alloc live;
+      std::vector<long*> blocks;
+      for( int k = 0; k != 1000; ++k )
+      {
+         long* p = live.allocate( 1 );
+         *p      = k + 1;
+         blocks.push_back( p );
+      }
+      dead.deallocate( q, 1 );
+      dead.trim();
+
+      int nof_lost = 0;
+      for( size_t k = 0; k != blocks.size(); ++k )
+      {
+         nof_lost += ( *blocks[k] != static_cast<long>(k + 1) );
+      }
+      check( nof_lost == 0, "fb_mmap_provider: trim() of one chunk zeroed its neighbours" );
+
+      for( size_t k = 0; k != blocks.size(); ++k )
+      {
+         live.deallocate( blocks[k], 1 );
+      }
+   }
+
+   //
+   // zero bytes are valid request for memory_resource, the block should
+   // still meet the alignment and go back to the pool it came from
+   //
+   void check_resource_zero_bytes( void )
+   {
+      fb_memory_resource res;
+
+      const size_t alignments[] = { 8, 16, 64 };
+      for( size_t alignment : alignments )
+      {
+         std::vector<void*> blocks;
+         for( int k = 0; k != 1000; ++k )
+         {
+            void* p = res.allocate( 0, alignment );
+            check( reinterpret_cast<uintptr_t>( p ) % alignment == 0, "fb_memory_resource: allocate( 0, alignment ) is misaligned" );
+            blocks.push_back( p );
+         }
+         for( size_t k = 0; k != blocks.size(); ++k )
+         {
+            res.deallocate( blocks[k], 0, alignment );
+         }
+      }
+   }
+
+   //
+   // allocate_n() which runs out of chunks gives the blocks back without
+   // reporting them to hooks, every on_deallocate has its on_allocate
+   //
+   struct counting_hooks : fb_no_hooks
+   {
+      static long nof_live;
+
+      template <typename U> static void on_allocate( const void*, const void*, size_t, const void* )
+      {
+         ++nof_live;
+      }
+
+      template <typename U> static void on_deallocate( const void*, const void*, size_t, const void* )
+      {
+         --nof_live;
+      }
+   };
+
+   long counting_hooks::nof_live = 0;
+
+   //
+   // gives nof_chunks chunks, then throws std::bad_alloc
+   //
+   class limited_provider : public fb_chunk_provider
+   {
+      public:
+
+         explicit limited_provider( int nof_chunks ) : nof_chunks_( nof_chunks ) {}
+
+         virtual char* allocate( size_t span )
+         {
+            if ( nof_chunks_ == 0 )
+            {
+               throw std::bad_alloc();
+            }
+            --nof_chunks_;
+            return static_cast<char*>( aligned_alloc( span, span ) );
+         }
+
+         virtual void deallocate( char* p, size_t )
+         {
+            free( p );
+         }
+
+      private:
+
+         int nof_chunks_;
+   };
+
+   void check_allocate_n_rollback_hooks( void )
+   {
+      typedef fb_alloc<double, 100, 8, counting_hooks> alloc;
+
+      static limited_provider provider( 2 );
+      alloc::set_provider( &provider );
+
+      alloc a;
+      std::vector<double*> blocks( 1000 );
+      bool thrown = false;
+      try
+      {
+         a.allocate_n( blocks.data(), blocks.size() );
+      }
+      catch( const std::bad_alloc& )
+      {
+         thrown = true;
+      }
+      check( thrown, "allocate_n(): no std::bad_alloc from the exhausted provider" );
+      check( counting_hooks::nof_live == 0, "allocate_n(): rollback reported to hooks" );
+      check( a.stats().live_blocks == 0 && a.stats().allocs == 0, "allocate_n(): rollback shows in the counters" );
+   }
+
+   //
+   // hooks get the site which called allocate(), even when it is inlined
+   //
+   struct site_hooks : fb_no_hooks
+   {
+      static const void* last_site;
+
+      template <typename U> static void on_allocate( const void*, const void*, size_t, const void* site )
+      {
+         last_site = site;
+      }
+   };
+
+   const void* site_hooks::last_site = 0;
+
+   typedef fb_alloc<float, 100, 8, site_hooks> site_alloc;
+
+   FB_NOINLINE float* allocate_here( site_alloc& a )
+   {
+      return a.allocate( 1 );
+   }
+
+   void check_call_site( void )
+   {
+      site_alloc a;
+      float*     p = allocate_here( a );
+
+      const char* here = reinterpret_cast<const char*>( &allocate_here );
+      const char* site = static_cast<const char*>( site_hooks::last_site );
+      check( site > here && site < here + 256, "FB_CALL_SITE(): site is not in the function which called allocate()" );
+
+      a.deallocate( p, 1 );
+   }
+}
+
+int main( void )
+{
+   check_mmap_trim_keeps_neighbours();
+   check_resource_zero_bytes();
+   check_allocate_n_rollback_hooks();
+   check_call_site();
+
+   if ( nof_failed == 0 )
+   {
+      std::printf( "all checks passed\n" );
+   }
+   return (nof_failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,548 @@
+// -*- C++ -*-
+
+//
+// Replay of allocation traces recorded with fb_trace_hooks (see fb_trace.h) against
+// fb_alloc configurations, short_alloc arenas and operator new, so nof_elements and
+// alignment could be picked from the real workload:
+//
+//    fb_replay trace.txt [trace.txt ...]
+//
+// Only allocate and deallocate records are replayed, in file order, on one thread.
+// Allocated blocks are zeroed, as construction would touch them.
+// Blocks freed in the trace but allocated before it started are skipped, blocks still
+// in use when it ends are never freed. Each element type gets pools of its own, as
+// fb_alloc<T> does. Element sizes are rounded up to 8 bytes (to size classes above
+// 256 bytes), types of the same rounded size share GLOBAL chunk list. Elements larger
+// than max_block go to operator new. Other system allocators could be compared by
+// running the tool under LD_PRELOAD.
+//
+// Every configuration is replayed in a child process of its own. Reported:
+//    ops_per_sec - replayed calls per second
+//    peak_rss_kb - growth of resident set during the replay, at its peak
+//    chunks      - spans taken from malloc by fb_alloc
+//    reserved_kb - bytes held in those chunks
+//    frag        - 1 - peak bytes in use / peak_rss_kb
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fb_alloc.h"
+#include "fb_size_class.h"
+#include "short_alloc.h"
+
+namespace
+{
+   //
+   // block sizes: 8, 16, ..., 256, then size classes 320, 384, ..., 1024
+   //
+   const std::size_t nof_exact  = 32;
+   const std::size_t first_rest = 13; // fb_class_index( 320 )
+   const std::size_t max_block  = 1024;
+   const std::size_t nof_sizes  = nof_exact + fb_class_index( max_block ) - first_rest + 1;
+
+   constexpr std::size_t size_at( std::size_t index )
+   {
+      return (index < nof_exact) ? 8*(index + 1) : fb_class_at( index - nof_exact + first_rest );
+   }
+
+   std::size_t index_of( std::size_t elsize )
+   {
+      return (elsize <= 8*nof_exact) ? (std::max<std::size_t>( elsize, 1 ) + 7)/8 - 1
+                                     : fb_class_index( elsize ) - first_rest + nof_exact;
+   }
+
+   //
+   // replayed call, block is the slot of the recorded pointer
+   //
+   struct op
+   {
+      uint32_t    block;
+      uint32_t    type;
+      uint32_t    elsize;
+      bool        free;
+      std::size_t n;
+   };
+
+   struct trace
+   {
+      std::vector<op> ops;
+      std::size_t     nof_records;
+      std::size_t     nof_blocks;  // slots needed
+      std::size_t     nof_types;
+      std::size_t     nof_threads;
+      std::size_t     peak_bytes;  // requested bytes in use, at the peak
+   };
+
+   //
+   // reads lines of fb_trace_ring::dump():
+   //    time event type size ptr pool site elsize elalign thread
+   // recorded pointers in use are mapped to block slots, freed slots are reused
+   //
+   class loader
+   {
+      public:
+
+         loader( void ) : trace_( trace() ), bytes_( 0 ) {}
+
+         bool load( const char* path );
+
+         const trace& result( void )
+         {
+            trace_.nof_types   = types_.size();
+            trace_.nof_threads = threads_.size();
+            return trace_;
+         }
+
+      private:
+
+         trace                                     trace_;
+         std::map<std::string, uint32_t>           types_;
+         std::set<std::string>                     threads_;
+         std::unordered_map<std::string, uint32_t> live_;  // recorded pointer -> slot
+         std::vector<uint32_t>                     spare_; // free slots
+         std::size_t                               bytes_; // requested bytes in use
+   };
+
+   bool loader::load( const char* path )
+   {
+      std::ifstream in( path );
+      if ( !in )
+      {
+         std::fprintf( stderr, "fb_replay: cannot open %s\n", path );
+         return false;
+      }
+
+      std::string line;
+      while ( std::getline( in, line ) )
+      {
+         std::istringstream is( line );
+         std::string time, event, type, ptr, pool, site, thread;
+         std::size_t n = 0, elsize = 0, elalign = 0;
+         if ( !(is >> time >> event >> type >> n >> ptr >> pool >> site >> elsize >> elalign >> thread) )
+         {
+            continue;
+         }
+         ++trace_.nof_records;
+
+         op o;
+         o.n      = n;
+         o.elsize = static_cast<uint32_t>( elsize );
+         if ( event == "allocate" )
+         {
+            o.free = false;
+            if ( spare_.empty() )
+            {
+               spare_.push_back( static_cast<uint32_t>( trace_.nof_blocks++ ) );
+            }
+            o.block = spare_.back();
+            spare_.pop_back();
+
+            //
+            // if free of the block at the same address was lost, the old block stays in use
+            //
+            live_[ptr] = o.block;
+            bytes_ += n*elsize;
+            trace_.peak_bytes = std::max( trace_.peak_bytes, bytes_ );
+         }
+         else if ( event == "deallocate" )
+         {
+            std::unordered_map<std::string, uint32_t>::iterator it = live_.find( ptr );
+            if ( it == live_.end() )
+            {
+               continue;
+            }
+            o.free  = true;
+            o.block = it->second;
+            spare_.push_back( it->second );
+            live_.erase( it );
+            bytes_ -= std::min( bytes_, n*elsize );
+         }
+         else
+         {
+            continue;
+         }
+
+         std::map<std::string, uint32_t>::iterator t = types_.find( type );
+         if ( t == types_.end() )
+         {
+            t = types_.insert( std::make_pair( type, static_cast<uint32_t>( types_.size() ) ) ).first;
+         }
+         o.type = t->second;
+         threads_.insert( thread );
+         trace_.ops.push_back( o );
+      }
+      return true;
+   }
+
+   //
+   // allocator under test
+   //
+   class target
+   {
+      public:
+
+         virtual ~target( void ) {}
+
+         virtual void* allocate( uint32_t type, std::size_t elsize, std::size_t n ) = 0;
+         virtual void  deallocate( void* p, uint32_t type, std::size_t elsize, std::size_t n ) = 0;
+
+         //
+         // chunks taken from malloc and bytes held in them
+         //
+         virtual void chunks( std::size_t& nof_chunks, std::size_t& reserved ) const
+         {
+            nof_chunks = 0;
+            reserved   = 0;
+         }
+   };
+
+   class new_target : public target
+   {
+      public:
+
+         virtual void* allocate( uint32_t, std::size_t elsize, std::size_t n )
+         {
+            return ::operator new( n*elsize );
+         }
+
+         virtual void deallocate( void* p, uint32_t, std::size_t, std::size_t )
+         {
+            ::operator delete( p );
+         }
+   };
+
+   //
+   // one arena for all types, blocks past the buffer go to operator new (Upstream == void)
+   // or to blocks chained from upstream
+   //
+   template <std::size_t N, typename Upstream> class short_target : public target
+   {
+      public:
+
+         short_target( void ) : arena_( new arena<N, 16, Upstream> ) {}
+
+         virtual void* allocate( uint32_t, std::size_t elsize, std::size_t n )
+         {
+            return arena_->allocate( n*elsize );
+         }
+
+         virtual void deallocate( void* p, uint32_t, std::size_t elsize, std::size_t n )
+         {
+            arena_->deallocate( static_cast<char*>( p ), n*elsize );
+         }
+
+      private:
+
+         std::unique_ptr< arena<N, 16, Upstream> > arena_;
+   };
+
+   //
+   // pool of one element type
+   //
+   class pool
+   {
+      public:
+
+         virtual ~pool( void ) {}
+
+         virtual void* allocate( std::size_t n ) = 0;
+         virtual void  deallocate( void* p, std::size_t n ) = 0;
+   };
+
+   template <std::size_t size, unsigned int nof_elements, std::size_t alignment> class fb_pool : public pool
+   {
+      public:
+
+         typedef fb_alloc< fb_block<size, 8>, nof_elements, alignment > alloc_type;
+
+         virtual void* allocate( std::size_t n )
+         {
+            return alloc_.allocate( n );
+         }
+
+         virtual void deallocate( void* p, std::size_t n )
+         {
+            alloc_.deallocate( static_cast<typename alloc_type::pointer>( p ), n );
+         }
+
+         static pool* make( void )
+         {
+            return new fb_pool;
+         }
+
+         static fb_pool_stats type_stats( void )
+         {
+            return alloc_type::type_stats();
+         }
+
+      private:
+
+         alloc_type alloc_;
+   };
+
+   //
+   // pool factory and type statistics for every block size
+   //
+   struct pool_kind
+   {
+      pool*         (* make)( void );
+      fb_pool_stats (* stats)( void );
+   };
+
+   template <unsigned int nof_elements, std::size_t alignment, std::size_t index> struct pool_table
+   {
+      static void fill( pool_kind* kinds )
+      {
+         typedef fb_pool<size_at( index - 1 ), nof_elements, alignment> pool_type;
+         kinds[index - 1].make  = &pool_type::make;
+         kinds[index - 1].stats = &pool_type::type_stats;
+         pool_table<nof_elements, alignment, index - 1>::fill( kinds );
+      }
+   };
+
+   template <unsigned int nof_elements, std::size_t alignment> struct pool_table<nof_elements, alignment, 0>
+   {
+      static void fill( pool_kind* ) {}
+   };
+
+   template <unsigned int nof_elements, std::size_t alignment> class fb_target : public target
+   {
+      public:
+
+         explicit fb_target( std::size_t nof_types ) : pools_( nof_types*nof_sizes )
+         {
+            pool_table<nof_elements, alignment, nof_sizes>::fill( kinds_ );
+         }
+
+         virtual void* allocate( uint32_t type, std::size_t elsize, std::size_t n )
+         {
+            if ( elsize > max_block )
+            {
+               return ::operator new( n*elsize );
+            }
+            return get( type, elsize ).allocate( n );
+         }
+
+         virtual void deallocate( void* p, uint32_t type, std::size_t elsize, std::size_t n )
+         {
+            if ( elsize > max_block )
+            {
+               ::operator delete( p );
+               return;
+            }
+            get( type, elsize ).deallocate( p, n );
+         }
+
+         virtual void chunks( std::size_t& nof_chunks, std::size_t& reserved ) const
+         {
+            nof_chunks = 0;
+            reserved   = 0;
+            for( std::size_t k = 0; k != nof_sizes; ++k )
+            {
+               fb_pool_stats st = kinds_[k].stats();
+               nof_chunks += st.provider_chunks;
+               reserved   += st.bytes_reserved;
+            }
+         }
+
+      private:
+
+         pool& get( uint32_t type, std::size_t elsize )
+         {
+            std::size_t index = index_of( elsize );
+            std::unique_ptr<pool>& p = pools_[type*nof_sizes + index];
+            if ( !p )
+            {
+               p.reset( kinds_[index].make() );
+            }
+            return *p;
+         }
+
+         pool_kind                           kinds_[nof_sizes];
+         std::vector< std::unique_ptr<pool> > pools_; // per type and block size
+   };
+
+   struct config
+   {
+      const char* name;
+      target*     (* make)( std::size_t nof_types );
+   };
+
+   template <typename T> target* make_target( std::size_t )
+   {
+      return new T;
+   }
+
+   template <unsigned int nof_elements, std::size_t alignment> target* make_fb( std::size_t nof_types )
+   {
+      return new fb_target<nof_elements, alignment>( nof_types );
+   }
+
+   const config configs[] =
+   {
+      { "operator new",              &make_target<new_target> },
+      { "short_alloc 1MB",           &make_target< short_target<1 << 20, void> > },
+      { "short_alloc 64KB chained",  &make_target< short_target<1 << 16, arena_heap_upstream> > },
+      { "fb_alloc<32,8>",            &make_fb<32, 8> },
+      { "fb_alloc<32,16>",           &make_fb<32, 16> },
+      { "fb_alloc<32,cache line>",   &make_fb<32, FB_ALIGN_CACHE_LINE> },
+      { "fb_alloc<100,8>",           &make_fb<100, 8> },
+      { "fb_alloc<100,16>",          &make_fb<100, 16> },
+      { "fb_alloc<100,cache line>",  &make_fb<100, FB_ALIGN_CACHE_LINE> },
+      { "fb_alloc<400,8>",           &make_fb<400, 8> },
+      { "fb_alloc<400,16>",          &make_fb<400, 16> },
+      { "fb_alloc<400,cache line>",  &make_fb<400, FB_ALIGN_CACHE_LINE> }
+   };
+
+   struct result
+   {
+      double      ops_per_sec;
+      long        peak_rss_kb;
+      std::size_t nof_chunks;
+      std::size_t reserved;
+   };
+
+   long status_kb( const char* field )
+   {
+      long res = 0;
+      std::FILE* f = std::fopen( "/proc/self/status", "r" );
+      if ( f != 0 )
+      {
+         char line[256];
+         std::size_t len = std::strlen( field );
+         while ( std::fgets( line, sizeof(line), f ) != 0 )
+         {
+            if ( std::strncmp( line, field, len ) == 0 )
+            {
+               res = std::atol( line + len );
+               break;
+            }
+         }
+         std::fclose( f );
+      }
+      return res;
+   }
+
+   //
+   // peak resident set is reset first, so VmHWM covers the replay only
+   // (Linux 4.0 and later, otherwise it includes the loaded trace)
+   //
+   result replay( const config& cfg, const trace& tr )
+   {
+      std::unique_ptr<target> t( cfg.make( tr.nof_types ) );
+      std::vector<void*>      blocks( tr.nof_blocks, static_cast<void*>(0) );
+
+      std::FILE* f = std::fopen( "/proc/self/clear_refs", "w" );
+      if ( f != 0 )
+      {
+         std::fputs( "5", f );
+         std::fclose( f );
+      }
+      long rss0 = status_kb( "VmRSS:" );
+
+      std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+      for( std::vector<op>::const_iterator o = tr.ops.begin(); o != tr.ops.end(); ++o )
+      {
+         if ( o->free )
+         {
+            t->deallocate( blocks[o->block], o->type, o->elsize, o->n );
+         }
+         else
+         {
+            blocks[o->block] = t->allocate( o->type, o->elsize, o->n );
+            std::memset( blocks[o->block], 0, o->n*o->elsize );
+         }
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+
+      result res;
+      res.ops_per_sec = (elapsed.count() > 0.0) ? tr.ops.size()/elapsed.count() : 0.0;
+      res.peak_rss_kb = std::max( status_kb( "VmHWM:" ) - rss0, 0L );
+      t->chunks( res.nof_chunks, res.reserved );
+      return res;
+   }
+
+   //
+   // configuration is replayed in the child, result comes back through the pipe
+   //
+   bool run( const config& cfg, const trace& tr, result& res )
+   {
+      int fd[2];
+      if ( pipe( fd ) != 0 )
+      {
+         return false;
+      }
+
+      pid_t pid = fork();
+      if ( pid == 0 )
+      {
+         close( fd[0] );
+         result r = replay( cfg, tr );
+         ssize_t written = write( fd[1], &r, sizeof(r) );
+         _exit( (written == static_cast<ssize_t>( sizeof(r) )) ? 0 : 1 );
+      }
+      close( fd[1] );
+
+      ssize_t got = (pid > 0) ? read( fd[0], &res, sizeof(res) ) : -1;
+      close( fd[0] );
+      if ( pid > 0 )
+      {
+         int status = 0;
+         waitpid( pid, &status, 0 );
+      }
+      return got == static_cast<ssize_t>( sizeof(res) );
+   }
+}
+
+int main( int argc, char* argv[] )
+{
+   if ( argc < 2 )
+   {
+      std::fprintf( stderr, "usage: fb_replay trace.txt [trace.txt ...]\n" );
+      return 2;
+   }
+
+   loader ld;
+   for( int k = 1; k != argc; ++k )
+   {
+      if ( !ld.load( argv[k] ) )
+      {
+         return 1;
+      }
+   }
+   const trace& tr = ld.result();
+
+   std::printf( "records %zu, replayed calls %zu, types %zu, threads %zu, peak in use %zu kB\n\n",
+                tr.nof_records, tr.ops.size(), tr.nof_types, tr.nof_threads, tr.peak_bytes/1024 );
+   std::printf( "%-26s %14s %12s %8s %12s %6s\n", "config", "ops_per_sec", "peak_rss_kb", "chunks", "reserved_kb", "frag" );
+
+   for( std::size_t k = 0; k != sizeof(configs)/sizeof(configs[0]); ++k )
+   {
+      result res;
+      if ( !run( configs[k], tr, res ) )
+      {
+         std::printf( "%-26s failed\n", configs[k].name );
+         continue;
+      }
+
+      double frag = (res.peak_rss_kb > 0) ? 1.0 - double(tr.peak_bytes)/(1024.0*res.peak_rss_kb) : 0.0;
+      std::printf( "%-26s %14.0f %12ld %8zu %12zu %6.2f\n", configs[k].name, res.ops_per_sec, res.peak_rss_kb,
+                   res.nof_chunks, res.reserved/1024, std::max( frag, 0.0 ) );
+   }
+   return 0;
+}
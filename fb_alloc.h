@@ -4,502 +4,3279 @@
 #define FB_ALLOC_H
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cstddef>
+#include <atomic>
 #include <memory>
 #include <new>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+//
+// CHUNKS_SHARED_BETWEEN_THREADS: GLOBAL chunk list could be used from many threads,
+// each thread keeps a magazine of free chunks. Single fb_alloc instance is still
+// supposed to be used by one thread at a time
+//
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+#include <mutex>
+#endif
+
+//
+// number of free chunks each thread may keep locally before
+// handing half of them back to the global chunk list
+//
+#ifndef CHUNKS_MAGAZINE_SIZE
+#define CHUNKS_MAGAZINE_SIZE 8
+#endif
+
+//
+// allocate(n) for 1 < n <= CHUNKS_MAX_RUN is served by contiguous runs of blocks
+// carved from chunks, n is rounded up to power of two, runs of each size are kept
+// on their own free list. Should be power of two
+//
+#ifndef CHUNKS_MAX_RUN
+#define CHUNKS_MAX_RUN 16
+#endif
+
+//
+// pool control blocks are aligned to cache line, so counters of
+// different pools never share the line
+//
+#ifndef CHUNKS_CACHE_LINE_SIZE
+#define CHUNKS_CACHE_LINE_SIZE 64
+#endif
+
+//
+// allocators rebound to types of different sizes share one pool if the smaller
+// element is at least 1/CHUNKS_SHARE_RATIO of the larger one, blocks are of the larger
+// size. 1 means only elements of the same size share the pool, 0 disables sharing
+// between rebound allocators at all
+//
+#ifndef CHUNKS_SHARE_RATIO
+#define CHUNKS_SHARE_RATIO 2
+#endif
+
+//
+// chunks of the pool grow geometrically: first chunk takes one span (see fb_alloc::span_),
+// each next one is twice as large up to CHUNKS_GROWTH_LIMIT spans, so big pools have
+// short chunk lists. Large chunk is made of span sized segments, each of them keeps
+// its own header, so blocks are still found by masking. Chunks of more than one span
+// bypass GLOBAL list. Should be power of two, 1 means fixed size chunks
+//
+#ifndef CHUNKS_GROWTH_LIMIT
+#define CHUNKS_GROWTH_LIMIT 1
+#endif
+
+//
+// CHUNKS_NUMA_NODES > 1 (with CHUNKS_SHARED_BETWEEN_THREADS): GLOBAL chunk list is split
+// into depots, one per NUMA node. New chunk is bound to the node of the thread which asked
+// for it, free chunks go back to the depot of their node and are given to threads of that
+// node only. Chunks move to another node only when provider fails. Should be the number
+// of nodes of the machine, node of the thread is asked for with getcpu (Linux only)
+//
+#ifndef CHUNKS_NUMA_NODES
+#define CHUNKS_NUMA_NODES 1
+#endif
+
+#if (CHUNKS_NUMA_NODES > 1) && !defined(CHUNKS_SHARED_BETWEEN_THREADS)
+#error "CHUNKS_NUMA_NODES requires CHUNKS_SHARED_BETWEEN_THREADS"
+#endif
+
+#if (CHUNKS_NUMA_NODES > 1) && defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+//
+// CHUNKS_HARDENED: free blocks are filled with FB_POISON_BYTE which is checked when the block
+// is taken again (write after free), free list links are XOR-masked with per process key and
+// checked to point into the pool, each chunk keeps bitmap of allocated blocks, so double free
+// is caught in O(1). Under AddressSanitizer free blocks are poisoned for it as well.
+// Failed check prints the block and aborts
+//
+#ifdef CHUNKS_HARDENED
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef FB_POISON_BYTE
+#define FB_POISON_BYTE 0xdd
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#define FB_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define FB_ASAN 1
+#endif
+#endif
+#endif
+
+#ifdef FB_ASAN
+#include <sanitizer/asan_interface.h>
+#define FB_ASAN_POISON(p, n)   ASAN_POISON_MEMORY_REGION( (p), (n) )
+#define FB_ASAN_UNPOISON(p, n) ASAN_UNPOISON_MEMORY_REGION( (p), (n) )
+#else
+#define FB_ASAN_POISON(p, n)   static_cast<void>(0)
+#define FB_ASAN_UNPOISON(p, n) static_cast<void>(0)
+#endif
+
+//
+// CHUNKS_LEAK_REPORT: pool giving its chunks back (release(), last allocator is gone)
+// while some of its blocks are still in use lists them to std::cerr, see fb_alloc::report_leaks()
+//
+#ifdef CHUNKS_LEAK_REPORT
+#include <iostream>
+#endif
+
+//
+// What to do with chunk given back to GLOBAL list when number of free chunks
+// there already reached high-water mark, see fb_alloc::set_high_water_mark()
+//
+enum fb_trim_mode
+{
+   FB_TRIM_RELEASE, // return chunk to malloc, same as FB_TRIM_MADVISE with CHUNKS_SHARED_BETWEEN_THREADS
+   FB_TRIM_MADVISE  // keep chunk in the list, but let OS drop its pages (MADV_DONTNEED)
+};
 
-template <typename T, unsigned int nof_elements=100, size_t alignment=8> class fb_alloc
+//
+// Upstream source of chunks, chunk of span bytes (power of two)
+// should be aligned to span
+//
+class fb_chunk_provider
 {
    public:
 
-      typedef size_t    size_type;
-      typedef ptrdiff_t difference_type;
-      
-      typedef T         value_type;
-      typedef T*        pointer;
-      typedef const T*  const_pointer;
-      
-      typedef T&        reference;
-      typedef const T&  const_reference;
-      
+      virtual ~fb_chunk_provider( void ) {}
+
+      virtual char* allocate( size_t span ) = 0;
+      virtual void  deallocate( char* p, size_t span ) = 0;
+};
+
+//
+// default provider, chunks are taken from malloc
+//
+class fb_heap_provider : public fb_chunk_provider
+{
+   public:
+
+      static fb_heap_provider& instance( void )
+      {
+         static fb_heap_provider hp;
+         return hp;
+      }
+
+      virtual char* allocate( size_t span )
+      {
+         void* p = 0;
+#ifdef _WIN32
+         p = _aligned_malloc( span, span );
+#else
+         if ( posix_memalign( &p, span, span ) != 0 )
+         {
+            p = 0;
+         }
+#endif
+         if ( p == 0 )
+         {
+            throw std::bad_alloc();
+         }
+         return static_cast<char*>( p );
+      }
+
+      virtual void deallocate( char* p, size_t )
+      {
+#ifdef _WIN32
+         _aligned_free( p );
+#else
+         free( p );
+#endif
+      }
+};
+
+//
+// provider over the bump arena (e.g. arena<N> of short_alloc.h) for the pool of its own,
+// see fb_alloc( fb_chunk_provider& ). Arena should provide
+//    char* allocate_aligned( size_t n, size_t align ) - 0 if there is no room.
+// Chunks are never given back one by one, they are gone with the arena reset
+//
+template <typename Arena> class fb_arena_provider : public fb_chunk_provider
+{
+   public:
+
+      explicit fb_arena_provider( Arena& a ) : arena_( a ) {}
+
+      virtual char* allocate( size_t span )
+      {
+         char* p = arena_.allocate_aligned( span, span );
+         if ( p == 0 )
+         {
+            throw std::bad_alloc();
+         }
+         return p;
+      }
+
+      virtual void deallocate( char*, size_t )
+      {
+      }
+
+   private:
+
+      Arena& arena_;
+};
+
+//
+// upstream of the chained arena (see arena of short_alloc.h) over the chunks of Alloc,
+// e.g. fb_alloc<char>. Blocks up to the chunk size are chunks taken from GLOBAL list
+// of the type and given back there, larger ones come straight from its provider
+// and are not counted in type_stats(). Chunk size is the natural first block:
+//
+// fb_depot_upstream< fb_alloc<char> >& up = fb_depot_upstream< fb_alloc<char> >::instance();
+// arena<4096, 0, fb_depot_upstream< fb_alloc<char> > > a( up, up.chunk_size() );
+//
+template <typename Alloc> class fb_depot_upstream
+{
+   public:
+
+      static fb_depot_upstream& instance( void )
+      {
+         static fb_depot_upstream up;
+         return up;
+      }
+
+      static size_t chunk_size( void )
+      {
+         return Alloc::span_;
+      }
+
+      char* allocate( size_t n )
+      {
+         return (n <= Alloc::span_) ? Alloc::allocate_chunk( 1 ) : Alloc::provider()->allocate( n );
+      }
+
       //
-      // ctors and dtors
-      //      
-      fb_alloc( void ) throw();
-      template <typename U> fb_alloc( const fb_alloc<U,nof_elements,alignment>& ) throw();
+      // arena wrote over the chunk header, chunk goes to the depot of the calling thread
+      //
+      void deallocate( char* p, size_t n )
+      {
+         if ( n <= Alloc::span_ )
+         {
+#if CHUNKS_NUMA_NODES > 1
+            Alloc::header_of( p )->node_ = Alloc::thread_node( Alloc::magazine_ );
+#endif
+            Alloc::deallocate_chunk( p, 1 );
+         }
+         else
+         {
+            Alloc::provider()->deallocate( p, n );
+         }
+      }
+};
+
+//
+// number of run free lists: runs of 2, 4, ..., CHUNKS_MAX_RUN blocks
+//
+inline constexpr unsigned int fb_log2( size_t n )
+{
+   return (n < 2) ? 0 : 1 + fb_log2( n/2 );
+}
+
+//
+// element size adjusted due to alignment restrictions, smallest multiple of alignment
+// which is not less than n, see fb_alloc::elsize_
+//
+inline constexpr size_t fb_round_up( size_t n, size_t alignment )
+{
+   return ( (n + alignment - 1)/alignment )*alignment;
+}
+
+//
+// smallest power of two which is not less than n
+//
+inline constexpr size_t fb_ceil_pow2( size_t n )
+{
+   return (n <= 1) ? 1 : 2*fb_ceil_pow2( (n + 1)/2 );
+}
+
+//
+// offset of the first block in the chunk of span bytes: chunk header, followed
+// by the bitmap with one bit for every block the chunk could hold if there is one.
+// Offset is aligned at least as malloc() result is, so blocks of sizes multiple of 16
+// are 16 bytes aligned whatever the alignment parameter is (see fb_memory_resource)
+//
+inline constexpr size_t fb_first_block( size_t header, size_t span, size_t elsize, size_t alignment, bool bitmap )
+{
+   return fb_round_up( header + (bitmap ? ((span/elsize + 63)/64)*8 : 0),
+                       (alignment > alignof(std::max_align_t)) ? alignment : alignof(std::max_align_t) );
+}
+
+//
+// smallest chunk, not less than span, which holds the first block offset, nof_elements
+// blocks and at least one byte after them
+//
+inline constexpr size_t fb_chunk_span( size_t span, size_t header, size_t elsize, size_t nof_elements, size_t alignment, bool bitmap )
+{
+   return ( fb_first_block( header, span, elsize, alignment, bitmap ) + elsize*nof_elements < span ) ? span :
+          fb_chunk_span( 2*span, header, elsize, nof_elements, alignment, bitmap );
+}
+
+//
+// index of the lowest set bit of nonzero w, see fb_alloc::for_each_live()
+//
+inline unsigned int fb_ctz64( uint64_t w )
+{
+#if defined(__GNUC__) || defined(__clang__)
+   return static_cast<unsigned int>( __builtin_ctzll( w ) );
+#else
+   unsigned int n = 0;
+   while ( !(w & 1) )
+   {
+      w >>= 1;
+      ++n;
+   }
+   return n;
+#endif
+}
+
+#ifdef CHUNKS_HARDENED
+//
+// secret mixed into free list links, differs from process to process
+//
+inline uintptr_t fb_link_key( void )
+{
+   static const uintptr_t key = ( (reinterpret_cast<uintptr_t>( &fb_first_block ) >> 4) ^ static_cast<uintptr_t>( time( 0 ) ) ) *
+                                static_cast<uintptr_t>( 0x9E3779B97F4A7C15ULL ) | 1;
+   return key;
+}
+
+inline void fb_hardening_failure( const char* what, const void* p )
+{
+   fprintf( stderr, "fb_alloc: %s, block %p\n", what, p );
+   abort();
+}
+#endif
+
+//
+// identity of the calling thread, address of its own thread local byte
+//
+inline const void* fb_thread_id( void )
+{
+   static thread_local char id;
+   return &id;
+}
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+//
+// Lock-free (Treiber) stack of free chunks. Chunk is linked through its first word.
+// Top of the stack is a pointer packed together with modification tag into one
+// 64bit word, every successful CAS bumps the tag, thus pop() of the chunk which
+// was taken and put back by another thread in between (ABA) fails and retries.
+// On 64bit platforms pointer is stored in lower 48 bits, tag in upper 16 bits.
+//
+// pop() reads the link of the top chunk before its CAS, meanwhile another thread could
+// pop the same chunk and use it. Chunk which has been on the stack is thus never given
+// back to the provider (see fb_alloc::retire_chunk()), its first page stays mapped, so
+// the stale read is harmless, CAS fails. Link is read and written as relaxed atomic,
+// the new owner writes it plainly, ThreadSanitizer needs race:fb_chunk_stack::pop suppressed.
+// Tagged top hides the chunks from leak checkers, so they are reported as leaked at exit.
+// Top takes the whole cache line, so pushes and pops of one type do not invalidate
+// the line of the stack of another type
+//
+class alignas(CHUNKS_CACHE_LINE_SIZE) fb_chunk_stack
+{
+   public:
+
+      constexpr fb_chunk_stack( void ) : top_(0) {}
 
-      ~fb_alloc( void ) throw();
-      
-      pointer allocate( size_t n, const void* hint = 0 );
-      void    deallocate( pointer p, size_t n );
-      
-      void    construct(  pointer p );
-      void    construct(  pointer p, const T& val );
-      void    destroy( pointer p );
-      
       //
-      // NOTE! this method only deallocate memory chunks, NOT making the calls to the object destructor
+      // push linked list of chunks head...tail with single CAS
       //
-      void   release( void ) throw ( const char* );
+      void push( char* head, char* tail )
+      {
+         uint64_t top = top_.load( std::memory_order_relaxed );
+         do
+         {
+            link( tail )->store( unpack( top ), std::memory_order_relaxed );
+         }
+         while ( !top_.compare_exchange_weak( top, pack( head, top ),
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed ) );
+      }
 
       //
-      // converters
+      // pop one chunk, returns 0 if stack is empty
       //
-      pointer       address( reference ) const;
-      const_pointer address( const_reference ) const;
-      
+      char* pop( void )
+      {
+         uint64_t top = top_.load( std::memory_order_acquire );
+         for( ;; )
+         {
+            char* res = unpack( top );
+            if ( res == 0 )
+            {
+               return 0;
+            }
+            char* next = link( res )->load( std::memory_order_relaxed );
+            if ( top_.compare_exchange_weak( top, pack( next, top ),
+                                             std::memory_order_acquire,
+                                             std::memory_order_acquire ) )
+            {
+               return res;
+            }
+         }
+      }
+
+   private:
+
+      static_assert( sizeof(std::atomic<char*>) == sizeof(char*), "chunk link should be plain pointer" );
+
+      static std::atomic<char*>* link( char* p )
+      {
+         return reinterpret_cast<std::atomic<char*>*>( p );
+      }
+
+      static const int      tag_shift = (sizeof(char*) == 8) ? 48 : 32;
+      static const uint64_t ptr_mask  = (uint64_t(1) << tag_shift) - 1;
+
+      static char* unpack( uint64_t top )
+      {
+         return reinterpret_cast<char*>( static_cast<uintptr_t>(top & ptr_mask) );
+      }
+
       //
-      // observers
+      // new top made from ptr and incremented tag of the old top
       //
-      size_type    max_size( void ) const throw();
-      
-      unsigned int nof_elmts( void ) const;
-      size_t       elsize( void ) const;
-      size_t       alignmnt( void ) const;
-      size_t       chunksize( void ) const;
-      
-      int          refcount( void ) const;
-      int          nof_allocs( void ) const;
+      static uint64_t pack( char* ptr, uint64_t top )
+      {
+         uint64_t tag = (top >> tag_shift) + 1;
+         return (tag << tag_shift) | (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)) & ptr_mask);
+      }
 
-      void         dump( std::ostream& os ) const;
+      std::atomic<uint64_t> top_;
+};
 
-   protected:
-    
-      void clean( void );
-      void grow( void ) throw (const std::bad_alloc&);
-      bool check( const pointer p ) const;
+#if CHUNKS_NUMA_NODES > 1
+//
+// NUMA node of the CPU the calling thread runs on, 0 if it is not known
+//
+inline unsigned int fb_numa_node( void )
+{
+   unsigned int cpu  = 0;
+   unsigned int node = 0;
+#if defined(__linux__) && defined(SYS_getcpu)
+   if ( syscall( SYS_getcpu, &cpu, &node, 0 ) != 0 )
+   {
+      node = 0;
+   }
+#endif
+   return node % CHUNKS_NUMA_NODES;
+}
+
+//
+// prefer node for the pages of [p, p + n), pages already touched are moved.
+// Best effort: chunks which do not cover whole pages are left alone
+//
+inline void fb_numa_bind( char* p, size_t n, unsigned int node )
+{
+#if defined(__linux__) && defined(SYS_mbind)
+   static const size_t page = static_cast<size_t>( sysconf(_SC_PAGESIZE) );
+   if ( n >= page && (reinterpret_cast<uintptr_t>(p) % page) == 0 )
+   {
+      unsigned long mask = 1UL << node;
+      syscall( SYS_mbind, p, n - n % page, 1 /* MPOL_PREFERRED */, &mask, 8*sizeof(mask), 2 /* MPOL_MF_MOVE */ );
+   }
+#else
+   static_cast<void>( p );
+   static_cast<void>( n );
+   static_cast<void>( node );
+#endif
+}
+#endif
+#endif
+
+//
+// fault pages of [p, p + n) in ahead of time, contents are kept. Locking is best effort
+//
+inline void fb_prefault_pages( char* p, size_t n, bool lock )
+{
+#ifndef _WIN32
+   static const size_t page = static_cast<size_t>( sysconf(_SC_PAGESIZE) );
+#else
+   static const size_t page = 4096;
+#endif
+   volatile char* q = p;
+   for( size_t k = 0; k < n; k += page )
+   {
+      q[k] = q[k];
+   }
+#ifndef _WIN32
+   if ( lock )
+   {
+      mlock( p, n );
+   }
+#else
+   static_cast<void>( lock );
+#endif
+}
 
-      char* allocate_chunk( void ) const;
-      void  deallocate_chunk( char* ptr ) const;
+//
+// statistics counter which could be read from any thread while it is updated.
+// Counters of the pool have single writer, so update is relaxed load and store,
+// no read-modify-write on the allocation path
+//
+class fb_counter
+{
+   public:
+
+      constexpr fb_counter( void ) : value_(0) {}
+
+      uint64_t get( void ) const       { return value_.load( std::memory_order_relaxed ); }
+      void     set( uint64_t v )       { value_.store( v, std::memory_order_relaxed ); }
+      void     add( uint64_t n )       { set( get() + n ); }
+      void     sub( uint64_t n )       { set( get() - n ); }
+
+   private:
+
+      std::atomic<uint64_t> value_;
+};
+
+//
+// counter updated by many threads, chunk events only. It takes the whole cache line
+//
+class alignas(CHUNKS_CACHE_LINE_SIZE) fb_shared_counter
+{
+   public:
+
+      constexpr fb_shared_counter( void ) : value_(0) {}
+
+      uint64_t get( void ) const       { return value_.load( std::memory_order_relaxed ); }
+      void     add( uint64_t n )       { value_.fetch_add( n, std::memory_order_relaxed ); }
+
+   private:
+
+      std::atomic<uint64_t> value_;
+};
+
+//
+// snapshot of the counters of one pool, see fb_alloc::stats(), or of all pools
+// of the element type (size class), see fb_alloc::type_stats().
+// Run of blocks is one allocation, but all its blocks are live
+//
+struct fb_pool_stats
+{
+   uint64_t allocs;          // allocations served from chunks
+   uint64_t frees;           // deallocations, release() frees everything
+   uint64_t grows;           // chunks added to the pool
+   uint64_t depot_chunks;    // chunks taken from GLOBAL list and thread magazines, per type only
+   uint64_t provider_chunks; // spans taken from malloc (or another provider), per type only
+   uint64_t free_chunks;     // chunks waiting in GLOBAL list, per type only
+   uint64_t live_blocks;     // blocks in use
+   uint64_t peak_blocks;     // high-water mark of live blocks, per type it is the sum over living pools
+   uint64_t bytes_reserved;  // chunks held by the pool, per type all chunks taken from provider
+   uint64_t bytes_in_use;    // bytes of live blocks
+
+   //
+   // share of reserved memory which is not in use
+   //
+   double fragmentation( void ) const
+   {
+      return (bytes_reserved != 0) ? 1.0 - double(bytes_in_use)/double(bytes_reserved) : 0.0;
+   }
+};
+
+inline std::ostream& operator<<( std::ostream& os, const fb_pool_stats& st )
+{
+   return os << "allocs="      << st.allocs
+             << " frees="      << st.frees
+             << " grows="      << st.grows
+             << " depot="      << st.depot_chunks
+             << " provider="   << st.provider_chunks
+             << " free="       << st.free_chunks
+             << " live="       << st.live_blocks
+             << " peak="       << st.peak_blocks
+             << " reserved="   << st.bytes_reserved
+             << " in_use="     << st.bytes_in_use
+             << " frag="       << st.fragmentation();
+}
+
+struct fb_pool_control;
+
+//
+// chunk handling of the type which created the pool. Pool could be shared by types
+// of the same element size, chunks should come from and go back to the depot
+// of the same type anyway
+//
+struct fb_pool_ops
+{
+   char* (* allocate_chunk_)( unsigned int nof_spans );
+   void  (* deallocate_chunk_)( char* chunk, unsigned int nof_spans );
+   void  (* clean_)( fb_pool_control* ctl );  // gives all chunks of the pool back
+   void  (* detach_)( fb_pool_control* ctl ); // drops the pool from the pools of the type
+};
+
+//
+// state of the pool, shared by all copies of the allocator. Control blocks
+// take whole cache lines, they are carved in batches and recycled through
+// free list shared by all types, so constructing allocator does not hit malloc
+// once the list is warmed up. Control blocks are never given back to malloc.
+//
+// Allocator rebound to the type of another element size uses the pool of the family
+// it was rebound from if sizes are close enough (see CHUNKS_SHARE_RATIO), otherwise
+// it gets its own pool, which joins the family. Family lives as long as
+// any allocator refers to any of its pools, so memory taken through the temporary
+// rebound allocator survives it and could be given back through another one.
+// Fields used by allocate()/deallocate() come first, in the first cache line,
+// type list links and statistics counters follow the chunk list. Remote free list
+// and the owner read by other threads take lines of their own
+//
+struct alignas(CHUNKS_CACHE_LINE_SIZE) fb_pool_control
+{
+   char*  pool_head_;  // head of the pool of available blocks
+   char*  bump_ptr_;   // next block to carve from the newest chunk, 0 if nothing to carve
+
+   char*  run_heads_[ fb_log2(CHUNKS_MAX_RUN) ]; // heads of the runs of 2, 4, ... blocks
+
+   size_t span_;       // chunk size of the pool
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   std::atomic<int> refcount_; // number of allocators referring to the family, kept by the root only,
+                               // copies could be made and destroyed on any thread
+#else
+   int    refcount_;   // number of allocators referring to the family, kept by the root only
+#endif
+
+   unsigned int grow_spans_; // size of the next chunk, in spans
+
+   size_t elsize_;     // block size of the pool
+   size_t first_;      // offset of the first block in each chunk, blocks follow the chunk header
+   size_t blocks_;     // bytes occupied by blocks in each chunk
+
+   const fb_pool_ops* ops_; // chunk handling of the type which created the pool, or adopted it
+
+   char*  chunk_head_; // head of the chunk list
+   char*  chunk_tail_; // the oldest chunk, chunk list goes back to GLOBAL list at once, see fb_alloc::clean()
+
+   fb_pool_control* root_;      // first pool of the family
+   fb_pool_control* next_;      // next pool of the family, pools are linked into the ring
+
+   fb_chunk_provider* upstream_; // source of chunks of the family, 0 for GLOBAL list
+
+   fb_pool_control* type_prev_; // pools of the type of ops_ are linked into the list
+   fb_pool_control* type_next_;
+
+   fb_counter allocs_;      // see fb_pool_stats
+   fb_counter frees_;
+   fb_counter live_blocks_;
+   fb_counter peak_blocks_;
+   fb_counter grows_;
+   fb_counter chunks_;      // spans of the chunks in the chunk list
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   alignas(CHUNKS_CACHE_LINE_SIZE) std::atomic<const void*> owner_;       // thread which allocates from the pool, see fb_alloc::own()
+   alignas(CHUNKS_CACHE_LINE_SIZE) std::atomic<char*>       remote_head_; // blocks freed by other threads, see fb_alloc::deallocate()
+#endif
+};
+
+//
+// control blocks ready for reuse. Pools of the family are released together by the type
+// of the last allocator, so blocks taken by one type are often given back by another
+//
+template <typename Dummy = void> struct fb_free_controls
+{
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   static fb_chunk_stack head_;
+#else
+   static char*          head_;
+#endif
+};
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+template <typename Dummy> fb_chunk_stack fb_free_controls<Dummy>::head_;
+#else
+template <typename Dummy> char*          fb_free_controls<Dummy>::head_ = 0;
+#endif
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+//
+// guards the rings of pools of all families. Allocator copies, rebound ones included,
+// could be made and destroyed on any thread, e.g. when blocks are freed remotely
+//
+template <typename Dummy = void> struct fb_family_mutex
+{
+   static std::mutex mutex_;
+};
+
+template <typename Dummy> std::mutex fb_family_mutex<Dummy>::mutex_;
+#endif
+
+//
+// address the allocator was called from, passed to the hooks. FB_CALL_SITE() is the
+// return address of the function it is used in, so it is taken in fb_alloc::call_site(),
+// which is never inlined, right from the entry points, which are always inlined.
+// Thus the site is in the code which called allocate(), whatever the optimizer does
+//
+#if defined(__GNUC__) || defined(__clang__)
+#define FB_CALL_SITE()   __builtin_return_address(0)
+#define FB_ALWAYS_INLINE inline __attribute__((always_inline))
+#define FB_NOINLINE      __attribute__((noinline))
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define FB_CALL_SITE()   _ReturnAddress()
+#define FB_ALWAYS_INLINE __forceinline
+#define FB_NOINLINE      __declspec(noinline)
+#else
+#define FB_CALL_SITE()   static_cast<void*>(0)
+#define FB_ALWAYS_INLINE inline
+#define FB_NOINLINE
+#endif
+
+//
+// chunk header about to be read, see fb_alloc::clean()
+//
+#if defined(__GNUC__) || defined(__clang__)
+#define FB_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define FB_PREFETCH(p) static_cast<void>(p)
+#endif
+
+//
+// Instrumentation policy of fb_alloc, called with the element type U of the allocator:
+//    on_allocate( pool, p, n, site )     - allocate(n) returned p, every element of
+//                                          allocate_n() is reported as allocate(1)
+//    on_deallocate( pool, p, n, site )   - deallocate(p, n) is called
+//    on_grow( pool, chunk, span )        - chunk is added to the pool
+//    on_allocate_chunk( chunk, span )    - chunk is taken from GLOBAL list or provider
+//    on_deallocate_chunk( chunk, span )  - chunk is given back to GLOBAL list or provider
+// Hooks are static, they could be called from many threads at once. fb_no_hooks
+// does nothing at all, see fb_trace.h for the tracing policy
+//
+struct fb_no_hooks
+{
+   template <typename U> static void on_allocate( const void*, const void*, size_t, const void* ) {}
+   template <typename U> static void on_deallocate( const void*, const void*, size_t, const void* ) {}
+   template <typename U> static void on_grow( const void*, const void*, size_t ) {}
+   template <typename U> static void on_allocate_chunk( const void*, size_t ) {}
+   template <typename U> static void on_deallocate_chunk( const void*, size_t ) {}
+};
+
+//
+// alignment argument of fb_alloc and fb_class_alloc, any other power of two is taken as is:
+//    FB_ALIGN_NATURAL    - blocks are aligned as the element type requires, so they are
+//                          packed as tight as the free list link allows
+//    FB_ALIGN_CACHE_LINE - each block takes whole cache lines, blocks handed to different
+//                          threads never share the line
+//
+enum fb_alignment : size_t
+{
+   FB_ALIGN_NATURAL    = 0,
+   FB_ALIGN_CACHE_LINE = CHUNKS_CACHE_LINE_SIZE
+};
+
+template <typename T, unsigned int nof_elements=100, size_t alignment=8, typename hooks=fb_no_hooks> class fb_alloc
+{
+   static_assert( CHUNKS_MAX_RUN >= 2 && (CHUNKS_MAX_RUN & (CHUNKS_MAX_RUN - 1)) == 0,
+                  "CHUNKS_MAX_RUN should be power of two" );
+   static_assert( nof_elements > 0, "chunk should hold at least one element" );
+   static_assert( CHUNKS_GROWTH_LIMIT >= 1 && (CHUNKS_GROWTH_LIMIT & (CHUNKS_GROWTH_LIMIT - 1)) == 0,
+                  "CHUNKS_GROWTH_LIMIT should be power of two" );
+   static_assert( (alignment & (alignment - 1)) == 0,
+                  "alignment should be power of two or FB_ALIGN_NATURAL" );
+
+   public:
+
+      typedef size_t    size_type;
+      typedef ptrdiff_t difference_type;
+      
+      typedef T         value_type;
+      typedef T*        pointer;
+      typedef const T*  const_pointer;
+      
+      typedef T&        reference;
+      typedef const T&  const_reference;
+
+      template <typename U> struct rebind
+      {
+         typedef fb_alloc<U,nof_elements,alignment,hooks> other;
+      };
+
+      //
+      // allocator follows the container on copy, move and swap, so moving the container
+      // just takes its nodes. Allocators are equal iff their pools are of the same family
+      //
+      typedef std::true_type  propagate_on_container_copy_assignment;
+      typedef std::true_type  propagate_on_container_move_assignment;
+      typedef std::true_type  propagate_on_container_swap;
+      typedef std::false_type is_always_equal;
+
+      //
+      // ctors and dtors
+      //      
+      fb_alloc( void ) noexcept;
+      fb_alloc( const fb_alloc& ) noexcept;
+
+      //
+      // pools of the family take chunks from upstream instead of GLOBAL list and never
+      // give them back: release() and the last allocator just forget the chunks, trim()
+      // does nothing. Upstream (e.g. fb_arena_provider) should outlive the family
+      // and drops all chunks at once when it is cleared
+      //
+      explicit fb_alloc( fb_chunk_provider& upstream ) noexcept;
+      template <typename U> fb_alloc( const fb_alloc<U,nof_elements,alignment,hooks>& ) noexcept;
+
+      ~fb_alloc( void ) noexcept;
+
+      fb_alloc& operator=( const fb_alloc& ) noexcept;
+      
+      pointer allocate( size_t n, const void* hint = 0 );
+      void    deallocate( pointer p, size_t n );
+
+      //
+      // batches of count single elements, counters are updated once per batch.
+      // Free blocks are taken first, the rest is carved from chunks in runs of adjacent blocks.
+      // If allocation fails, blocks already taken are given back, neither hooks nor counters
+      // see them, and std::bad_alloc is thrown
+      //
+      void    allocate_n( pointer* ptrs, size_t count );
+      void    deallocate_n( pointer* ptrs, size_t count );
+      
+      template <typename U, typename... Args> void construct( U* p, Args&&... args );
+      template <typename U> void destroy( U* p );
+      
+      //
+      // NOTE! this method only deallocate memory chunks, NOT making the calls to the object destructor
+      //
+      void   release( void );
+
+      //
+      // all blocks of the family are dropped at once, in use or not, like arena::reset().
+      // Chunk list of each pool goes back to GLOBAL list in one go, allocator and its copies
+      // stay usable. Containers of the family should be gone or never touch their nodes
+      // again, see fb_scope.h. NOTE! destructors are not called either, so allocators living
+      // in the dropped blocks still count as references, nof_dropped of them are forgotten
+      //
+      void   reset( int nof_dropped = 0 );
+
+      //
+      // CHUNKS_SHARED_BETWEEN_THREADS: pool is owned by the thread which created it.
+      // deallocate() from other threads does not touch the free lists, blocks go to
+      // the lock-free remote list of the pool instead and the owner takes all of them
+      // back at once when its free list runs dry. Only the owner should allocate,
+      // own() makes the calling thread the owner of all pools of the family.
+      // Allocator copies could be made and destroyed on any thread
+      //
+      void   own( void );
+
+      //
+      // give chunks without live blocks back to GLOBAL list, returns number of chunks.
+      // Pools with upstream keep their chunks
+      //
+      int    trim( void );
+
+      //
+      // warm start for latency critical code, allocations which follow do not reach the provider.
+      // reserve() adds chunks for at least nof_blocks blocks to the pool at once, all their
+      // blocks go to the free list, so their pages are touched. Throws std::bad_alloc
+      //
+      void   reserve( size_t nof_blocks, bool lock = false );
+
+      //
+      // nof_chunks fresh chunks with pages touched are put into GLOBAL list to be taken
+      // by any pool of the type, up to high-water mark. Returns number of chunks added,
+      // less if provider fails. With CHUNKS_SHARED_BETWEEN_THREADS it could run on
+      // the background thread, chunks go to the NUMA node of the calling thread.
+      // There is no GLOBAL list with CHUNKS_RETURNED_TO_MALLOC, nothing is done.
+      // lock: pages are locked in memory with mlock(), best effort (RLIMIT_MEMLOCK).
+      // Locked chunks stay locked until they are given back to the provider
+      //
+      static int prefault( int nof_chunks, bool lock = false );
+
+      //
+      // keep at most nof_chunks free chunks in GLOBAL list, negative value means no limit.
+      // Supposed to be set up once, before the allocator is used
+      //
+      static void set_high_water_mark( int nof_chunks, fb_trim_mode mode = FB_TRIM_RELEASE );
+
+      //
+      // upstream source of chunks, 0 means heap. Provider should outlive all chunks
+      // taken from it and is supposed to be set up once, before the allocator is used
+      //
+      static void set_provider( fb_chunk_provider* provider );
+
+      //
+      // converters
+      //
+      pointer       address( reference ) const;
+      const_pointer address( const_reference ) const;
+      
+      //
+      // observers
+      //
+      size_type    max_size( void ) const noexcept;
+      
+      unsigned int nof_elmts( void ) const;
+      size_t       elsize( void ) const;
+      size_t       alignmnt( void ) const;
+      size_t       chunksize( void ) const;
+      
+      int          refcount( void ) const;
+      int          nof_allocs( void ) const;
+
+      //
+      // counters of our pool and of all pools of our element type, safe to call from
+      // any thread. Counters are relaxed, the snapshot is not taken atomically
+      //
+      fb_pool_stats        stats( void ) const;
+      static fb_pool_stats type_stats( void );
+
+      void         dump( std::ostream& os ) const;
+
+      //
+      // blocks in use, in address order: f( p ) is called for each of them, returns their number.
+      // Occupancy is found from the free lists when asked, so allocate() and deallocate() pay
+      // nothing for it. Blocks of the run are reported one by one. Should be called
+      // by the thread using the pool
+      //
+      template <typename F> size_t for_each_live( F f ) const;
+
+      //
+      // lists blocks still in use, returns their number, see CHUNKS_LEAK_REPORT
+      //
+      size_t       report_leaks( std::ostream& os ) const;
+
+      //
+      // memory taken from one allocator could be given back to another one
+      // iff both of them belong to the same family of pools
+      //
+      template <typename U> bool same_family( const fb_alloc<U,nof_elements,alignment,hooks>& fba ) const noexcept;
+
+   protected:
+    
+      static void clean( fb_pool_control* ctl );
+      static void clean_family( fb_pool_control* root, bool report );
+      static bool splice_chunks( fb_pool_control* ctl );
+      void  grow( void ); // throws std::bad_alloc
+      char* carve( size_t nbytes );
+      char* add_chunk( void );
+      char* miss( char*& head, size_t nbytes );
+      bool  check( const pointer p ) const;
+
+      bool                pooled_run( size_t n ) const;
+      static unsigned int run_class( size_t n );
+
+      static char* allocate_chunk( unsigned int nof_spans );
+      static void  deallocate_chunk( char* ptr, unsigned int nof_spans );
+      static bool retire_chunk( char* ptr, int nof_free );
+      char* unlink_empty( char* head ) const;
+
+   private:
+
+      template <typename U, unsigned int, size_t, typename> friend class fb_alloc;
+      template <typename Alloc> friend class fb_depot_upstream;
+
+      struct alloc_link
+      {
+         struct alloc_link* next_;
+      };
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      //
+      // block in the remote list, run class is kept only by runs
+      //
+      struct remote_link
+      {
+         uintptr_t    next_;       // next block, lowest bit is set if the block is the run
+         unsigned int run_class_;  // see run_class()
+      };
+
+      bool owned( void ) const;
+      bool drain_remote( void );
+      void push_remote( char* head, char* tail );
+#endif
+
+      //
+      // kept at the very beginning of each chunk (segment), so walking the chunk list
+      // touches one cache line per chunk and the next header could be prefetched
+      //
+      struct chunk_header
+      {
+         char*        next_;      // next chunk in the chunk list, kept by the first segment
+         const void*  owner_;     // pool the chunk belongs to, 0 while chunk is trimmed
+         unsigned int live_;      // number of blocks and runs in use in the segment
+         unsigned int nof_spans_; // segments from this one to the end of the chunk
+#if CHUNKS_NUMA_NODES > 1
+         unsigned int node_;      // NUMA node of the chunk memory, kept while chunk is free
+#endif
+      };
+
+      static fb_pool_control* acquire_control( void ) noexcept;
+      static fb_pool_control* join_family( fb_pool_control* family ) noexcept;
+      static void             release_family( fb_pool_control* root ) noexcept;
+      static void             release_control( fb_pool_control* ctl ) noexcept;
+      static void             reset_control( fb_pool_control* ctl ) noexcept;
+
+      static void             attach( fb_pool_control* ctl ) noexcept;
+      static void             detach( fb_pool_control* ctl ) noexcept;
+      static fb_pool_stats    pool_stats( const fb_pool_control* ctl );
+
+      template <typename F> static size_t visit_live( const fb_pool_control* ctl, F& f );
+      static void             mark_free( const fb_pool_control* ctl, const std::vector<char*>& segs,
+                                         uint64_t* bits, char* p, size_t nof_blocks );
+      static size_t           leak_report( const fb_pool_control* ctl, std::ostream& os ) noexcept;
+
+      template <typename F> struct live_visitor
+      {
+         F& f_;
+
+         void operator()( char* p )
+         {
+            f_( static_cast<pointer>( static_cast<void*>(p) ) );
+         }
+      };
+
+      struct leak_printer
+      {
+         static const size_t max_listed = 16;
+
+         const char* listed_[max_listed];
+         size_t      count_;
+
+         void operator()( char* p )
+         {
+            if ( count_ < max_listed )
+            {
+               listed_[count_] = p;
+            }
+            ++count_;
+         }
+      };
+
+      void count_alloc( size_t nof_allocs, size_t nof_blocks );
+      void count_free( size_t nof_frees, size_t nof_blocks );
+
+      //
+      // entry points with the call site given, 0 for fb_no_hooks
+      //
+      pointer allocate_at( size_type n, const void* site );
+      void    deallocate_at( pointer p, size_type n, const void* site );
+      void    allocate_n_at( pointer* ptrs, size_t count, const void* site );
+      void    deallocate_n_at( pointer* ptrs, size_t count, const void* site );
+
+      static const void* call_site( void );
+
+      void free_blocks( pointer* ptrs, size_t count );
+
+      char* bump_end( void ) const;
+
+      static chunk_header* header_of( char* chunk );
+
+      //
+      // free block list links, masked and checked in hardened mode
+      //
+      char*        next_block( char* p ) const;
+      static char* decode_link( char* p );
+      static void  link_block( char* p, char* next );
+
+      //
+      // no-ops unless hardened: claim() marks the block allocated (recycled block should
+      // still be poisoned), unmark() catches double free, poison() fills the free block
+      //
+      void         claim( char* p, size_t nbytes, bool recycled ) const;
+      void         unmark( char* p ) const;
+      void         poison( char* p, size_t nbytes ) const;
+#ifdef CHUNKS_HARDENED
+      uint64_t*    bitmap_word( char* p, uint64_t& bit ) const;
+#endif
+      static char*       chunk_of( const void* p, size_t span );
+
+      chunk_header*        block_header( const void* p ) const;
+
+      static bool        shareable( size_t elsize, size_t pool_elsize );
+      static void        adopt( fb_pool_control* ctl );
+
+      static fb_chunk_provider* provider( void );
+
+      //
+      // chunk geometry, everything is known at compile time.
+      // Block should be able to keep the link while it is in the free list.
+      // Chunk occupies power of two bytes and is aligned to its size,
+      // so the chunk which holds some block is found by masking the block address.
+      // Blocks follow the chunk header, space left after nof_elements blocks is used
+      // for additional blocks. At least one byte is left after the blocks, so the end
+      // of the blocks still masks to their chunk
+      //
+      static constexpr size_t       alignment_ = (alignment != FB_ALIGN_NATURAL)        ? alignment :
+                                                 (alignof(T) > alignof(alloc_link)) ? alignof(T) : alignof(alloc_link); // alignment value
+      static constexpr size_t       elsize_    = fb_round_up( (sizeof(T) < sizeof(alloc_link)) ? sizeof(alloc_link) : sizeof(T),
+                                                              alignment_ ); // element size adjusted due to alignment restrictions
+#ifdef CHUNKS_HARDENED
+      static constexpr bool         bitmap_    = true;  // chunk header is followed by bitmap of allocated blocks
+#else
+      static constexpr bool         bitmap_    = false;
+#endif
+      static constexpr size_t       span_      = fb_chunk_span( fb_ceil_pow2( sizeof(chunk_header) + elsize_*nof_elements + 1 ),
+                                                                sizeof(chunk_header), elsize_, nof_elements, alignment_, bitmap_ ); // chunk size
+      static constexpr size_t       first_     = fb_first_block( sizeof(chunk_header), span_, elsize_, alignment_, bitmap_ ); // offset of the first block
+      static constexpr unsigned int nof_elmts_ = static_cast<unsigned int>( (span_ - first_ - 1)/elsize_ ); // number of elements in one chunk
+
+      static_assert( first_ % alignof(std::max_align_t) == 0, "first block should be aligned as malloc() result" );
+      
+      fb_pool_control* ctl_; // pool shared with the copies, never 0
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      typedef fb_shared_counter type_counter;
+#else
+      typedef fb_counter        type_counter;
+#endif
+
+      static type_counter depot_chunks_;    // chunks taken from GLOBAL list, see fb_pool_stats
+      static type_counter provider_chunks_; // spans taken from provider
+      static type_counter released_chunks_; // spans given back to provider
+
+      static fb_pool_control* pools_; // head of the list of pools of our type
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      static std::mutex       pools_mutex_;
+#endif
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      //
+      // thread local cache of free chunks, chunks are moved between
+      // magazine and lock-free GLOBAL chunk stack in batches
+      //
+      struct chunk_magazine
+      {
+         char*        head_;  // head of the thread local chunk list
+         int          count_; // number of chunks in the magazine
+         unsigned int node_;  // NUMA node of the thread + 1, 0 until it is known
+
+         ~chunk_magazine( void );
+      };
+
+      static void         refill_magazine( chunk_magazine& mag );
+      static void         flush_magazine( chunk_magazine& mag, int nof_chunks );
+      static char*        fresh_chunk( chunk_magazine& mag );
+      static unsigned int thread_node( chunk_magazine& mag );
+      static unsigned int chunk_node( char* chunk );
+
+      static fb_chunk_stack    global_chunk_stack_[CHUNKS_NUMA_NODES]; // GLOBAL chunk list, per NUMA node
+      alignas(CHUNKS_CACHE_LINE_SIZE) static std::atomic<int> nof_allocated_chunks_; // number of allocated chunks kept in global list
+      alignas(CHUNKS_CACHE_LINE_SIZE) static std::atomic<int> nof_free_chunks_;      // number of free chunks in global list, never less than actual
+
+      static thread_local chunk_magazine magazine_; // chunks cached by the calling thread
+#else
+      static char*  global_chunk_head_;    // head of the GLOBAL chunk list
+      static int    nof_allocated_chunks_; // number of allocated chunks kept in global list
+      static int    nof_free_chunks_;      // number of free chunks in global list
+#endif
+
+      static const fb_pool_ops  ops_;             // chunk handling of pools created by this type
+      static fb_pool_control    null_control_;    // used when control block could not be allocated, owns no chunks
+
+      static int                high_water_mark_; // max number of free chunks in GLOBAL list, -1 if unlimited
+      static fb_trim_mode       trim_mode_;       // what to do with chunks above high-water mark
+      static fb_chunk_provider* provider_;        // upstream source of chunks, 0 for heap
+};
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  fb_chunk_stack
+fb_alloc<T,nof_elements,alignment,hooks>::global_chunk_stack_[CHUNKS_NUMA_NODES];
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  alignas(CHUNKS_CACHE_LINE_SIZE) std::atomic<int>
+fb_alloc<T,nof_elements,alignment,hooks>::nof_allocated_chunks_( 0 );
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  alignas(CHUNKS_CACHE_LINE_SIZE) std::atomic<int>
+fb_alloc<T,nof_elements,alignment,hooks>::nof_free_chunks_( 0 );
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  thread_local
+typename fb_alloc<T,nof_elements,alignment,hooks>::chunk_magazine
+fb_alloc<T,nof_elements,alignment,hooks>::magazine_;
+#else
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  char*
+fb_alloc<T,nof_elements,alignment,hooks>::global_chunk_head_ = 0;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  int
+fb_alloc<T,nof_elements,alignment,hooks>::nof_allocated_chunks_ = 0;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  int
+fb_alloc<T,nof_elements,alignment,hooks>::nof_free_chunks_ = 0;
+#endif
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>
+typename fb_alloc<T,nof_elements,alignment,hooks>::type_counter
+fb_alloc<T,nof_elements,alignment,hooks>::depot_chunks_;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>
+typename fb_alloc<T,nof_elements,alignment,hooks>::type_counter
+fb_alloc<T,nof_elements,alignment,hooks>::provider_chunks_;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>
+typename fb_alloc<T,nof_elements,alignment,hooks>::type_counter
+fb_alloc<T,nof_elements,alignment,hooks>::released_chunks_;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  fb_pool_control*
+fb_alloc<T,nof_elements,alignment,hooks>::pools_ = 0;
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  std::mutex
+fb_alloc<T,nof_elements,alignment,hooks>::pools_mutex_;
+#endif
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  const fb_pool_ops
+fb_alloc<T,nof_elements,alignment,hooks>::ops_ = { &allocate_chunk, &deallocate_chunk, &clean, &detach };
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  fb_pool_control
+fb_alloc<T,nof_elements,alignment,hooks>::null_control_ = { 0, 0, {}, span_, {}, 1, elsize_, first_, elsize_*nof_elmts_, &ops_, 0, 0, 0, 0, 0, 0, 0,
+                                                      {}, {}, {}, {}, {}, {}
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+                                                      , {}, {}
+#endif
+                                                    };
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  int
+fb_alloc<T,nof_elements,alignment,hooks>::high_water_mark_ = -1;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  fb_trim_mode
+fb_alloc<T,nof_elements,alignment,hooks>::trim_mode_ = FB_TRIM_RELEASE;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  fb_chunk_provider*
+fb_alloc<T,nof_elements,alignment,hooks>::provider_ = 0;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  constexpr size_t
+fb_alloc<T,nof_elements,alignment,hooks>::alignment_;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  constexpr size_t
+fb_alloc<T,nof_elements,alignment,hooks>::elsize_;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  constexpr bool
+fb_alloc<T,nof_elements,alignment,hooks>::bitmap_;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  constexpr size_t
+fb_alloc<T,nof_elements,alignment,hooks>::first_;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  constexpr size_t
+fb_alloc<T,nof_elements,alignment,hooks>::span_;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  constexpr unsigned int
+fb_alloc<T,nof_elements,alignment,hooks>::nof_elmts_;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> 
+fb_alloc<T,nof_elements,alignment,hooks>::fb_alloc( void ) noexcept:
+   ctl_( acquire_control() )
+{
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>
+fb_alloc<T,nof_elements,alignment,hooks>::fb_alloc( fb_chunk_provider& upstream ) noexcept:
+   ctl_( acquire_control() )
+{
+   if ( ctl_ != &null_control_ )
+   {
+      ctl_->upstream_ = &upstream;
+   }
+}
+
+//
+// copy constructor, shares the pool the same way as the member template does
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>
+fb_alloc<T,nof_elements,alignment,hooks>::fb_alloc( const fb_alloc& fba ) noexcept:
+   ctl_( fba.ctl_ )
+{
+   if ( ctl_ != &null_control_ )
+   {
+      int refs = ++ctl_->root_->refcount_;
+      assert( refs > 0 );
+      static_cast<void>( refs );
+   }
+}
+
+//
+// copy constructor, supposed to be member template
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> template <typename U> 
+fb_alloc<T,nof_elements,alignment,hooks>::fb_alloc( const fb_alloc<U,nof_elements,alignment,hooks>& fba ) noexcept:
+   ctl_( &null_control_ )
+{
+   //
+   // Use the pool of close enough element size from the same family, see join_family()
+   //
+   if ( fba.ctl_ == &fb_alloc<U,nof_elements,alignment,hooks>::null_control_ )
+   {
+      if ( elsize_ != fba.elsize_ )
+      {
+         ctl_ = acquire_control();
+      }
+      return;
+   }
+
+   ctl_ = join_family( fba.ctl_ );
+   if ( ctl_ != &null_control_ )
+   {
+      int refs = ++ctl_->root_->refcount_;
+      assert( refs > 0 );
+      static_cast<void>( refs );
+   }
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>
+fb_alloc<T,nof_elements,alignment,hooks>::~fb_alloc( void ) noexcept
+{
+   if ( ctl_ != &null_control_ )
+   {
+      fb_pool_control* root = ctl_->root_;
+      int              refs = --root->refcount_;
+      assert( refs >= 0 );
+      if ( refs == 0 )
+      {
+         release_family( root );
+      }
+   }
+}
+
+//
+// drop our share of the old pool and join the pool of fba
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> fb_alloc<T,nof_elements,alignment,hooks>&
+fb_alloc<T,nof_elements,alignment,hooks>::operator=( const fb_alloc& fba ) noexcept
+{
+   if ( ctl_ != fba.ctl_ )
+   {
+      fb_alloc tmp( fba );
+      fb_pool_control* ctl = ctl_;
+      ctl_     = tmp.ctl_;
+      tmp.ctl_ = ctl;
+   }
+   return *this;
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void 
+fb_alloc<T,nof_elements,alignment,hooks>::release( void )
+{
+   if ( ctl_ != &null_control_ )
+   {
+      fb_pool_control* root = ctl_->root_;
+      int              refs = --root->refcount_;
+      assert( refs >= 0 );
+      if ( refs == 0 )
+      {
+         //
+         // this delete all memory blocks of the whole family
+         //
+         clean_family( root, true );
+         root->refcount_ = 1;
+      }
+   }
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::reset( int nof_dropped )
+{
+   if ( ctl_ != &null_control_ )
+   {
+      fb_pool_control* root = ctl_->root_;
+      int refs = root->refcount_ -= nof_dropped;
+      assert( refs > 0 );
+      static_cast<void>( refs );
+      clean_family( root, false );
+   }
+}
+
+//
+// each pool is cleaned by the type which created it, blocks still in use
+// are reported if asked, see CHUNKS_LEAK_REPORT
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::clean_family( fb_pool_control* root, bool report )
+{
+#ifndef CHUNKS_LEAK_REPORT
+   static_cast<void>( report );
+#endif
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   std::lock_guard<std::mutex> lock( fb_family_mutex<>::mutex_ );
+#endif
+   fb_pool_control* ctl = root;
+   do
+   {
+#ifdef CHUNKS_LEAK_REPORT
+      if ( report )
+      {
+         leak_report( ctl, std::cerr );
+      }
+#endif
+      ctl->ops_->clean_( ctl );
+      ctl = ctl->next_;
+   }
+   while ( ctl != root );
+}
+
+//
+// take control block from the free list, when it is empty carve the whole batch
+// of them from one heap block. Returns null_control_ if heap is exhausted
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>
+fb_pool_control*
+fb_alloc<T,nof_elements,alignment,hooks>::acquire_control( void ) noexcept
+{
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   char* p = fb_free_controls<>::head_.pop();
+#else
+   char* p = fb_free_controls<>::head_;
+   if ( p != 0 )
+   {
+      fb_free_controls<>::head_ = *(char**)(p);
+   }
+#endif
+   if ( p == 0 )
+   {
+      static const size_t batch = fb_ceil_pow2( 16*sizeof(fb_pool_control) );
+
+      char* start = 0;
+      try
+      {
+         start = fb_heap_provider::instance().allocate( batch );
+      }
+      catch( const std::bad_alloc& )
+      {
+         return &null_control_;
+      }
+
+      //
+      // first control block is ours, the rest goes to the free list
+      //
+      char* last = start + (batch/sizeof(fb_pool_control) - 1)*sizeof(fb_pool_control);
+      for( char* q = start + sizeof(fb_pool_control); q < last; q += sizeof(fb_pool_control) )
+      {
+         *(char**)(q) = q + sizeof(fb_pool_control);
+      }
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      fb_free_controls<>::head_.push( start + sizeof(fb_pool_control), last );
+#else
+      *(char**)(last)           = fb_free_controls<>::head_;
+      fb_free_controls<>::head_ = start + sizeof(fb_pool_control);
+#endif
+      p = start;
+   }
+
+   fb_pool_control* ctl = static_cast<fb_pool_control*>( static_cast<void*>(p) );
+   ctl->allocs_.set( 0 );
+   ctl->peak_blocks_.set( 0 );
+   ctl->grows_.set( 0 );
+   reset_control( ctl );
+   ctl->refcount_ = 1;
+   ctl->root_     = ctl;
+   ctl->next_     = ctl;
+   ctl->ops_      = 0;
+   ctl->upstream_ = 0;
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   ctl->owner_.store( fb_thread_id(), std::memory_order_relaxed );
+#endif
+   adopt( ctl );
+   return ctl;
+}
+
+//
+// pool for our elements from the family of the given pool:
+//    - pool of the same element size,
+//    - pool of larger element size, if our elements are not too small for its blocks,
+//    - pool of smaller element size which has no chunks yet, it takes our geometry,
+//    - otherwise new pool is added to the family.
+// Returns null_control_ if heap is exhausted
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>
+fb_pool_control*
+fb_alloc<T,nof_elements,alignment,hooks>::join_family( fb_pool_control* family ) noexcept
+{
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   std::lock_guard<std::mutex> lock( fb_family_mutex<>::mutex_ );
+#endif
+   fb_pool_control* ctl = family;
+   do
+   {
+      if ( shareable( elsize_, ctl->elsize_ ) )
+      {
+         return ctl;
+      }
+      ctl = ctl->next_;
+   }
+   while ( ctl != family );
+
+   do
+   {
+      if ( ctl->chunk_head_ == 0 && shareable( ctl->elsize_, elsize_ ) )
+      {
+         adopt( ctl );
+         return ctl;
+      }
+      ctl = ctl->next_;
+   }
+   while ( ctl != family );
+
+   ctl = acquire_control();
+   if ( ctl != &null_control_ )
+   {
+      ctl->root_     = family->root_;
+      ctl->refcount_ = 0;
+      ctl->upstream_ = family->upstream_;
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      ctl->owner_.store( family->owner_.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+#endif
+      ctl->next_     = family->next_;
+      family->next_  = ctl;
+   }
+   return ctl;
+}
+
+//
+// last allocator is gone, give back chunks of all pools of the family, each pool
+// is cleaned by the type which created it
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::release_family( fb_pool_control* root ) noexcept
+{
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   std::lock_guard<std::mutex> lock( fb_family_mutex<>::mutex_ );
+#endif
+   fb_pool_control* ctl = root;
+   do
+   {
+      fb_pool_control* next = ctl->next_;
+#ifdef CHUNKS_LEAK_REPORT
+      leak_report( ctl, std::cerr );
+#endif
+      ctl->ops_->clean_( ctl );
+      release_control( ctl );
+      ctl = next;
+   }
+   while ( ctl != root );
+}
+
+//
+// elements of elsize bytes could be kept in blocks of the pool of pool_elsize bytes.
+// Naturally aligned blocks of the pool should keep the alignment of the elements
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline bool
+fb_alloc<T,nof_elements,alignment,hooks>::shareable( size_t elsize, size_t pool_elsize )
+{
+   return (elsize == pool_elsize) ||
+          ( (CHUNKS_SHARE_RATIO > 0) && (elsize <= pool_elsize) && (elsize*CHUNKS_SHARE_RATIO >= pool_elsize) &&
+            ( (alignment != FB_ALIGN_NATURAL) || pool_elsize % (elsize & (0 - elsize)) == 0 ) );
+}
+
+//
+// pool takes our geometry and chunk handling, it should have no chunks.
+// It moves to the list of our pools
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::adopt( fb_pool_control* ctl )
+{
+   assert( ctl->chunk_head_ == 0 );
+
+   if ( ctl->ops_ != 0 )
+   {
+      ctl->ops_->detach_( ctl );
+   }
+   ctl->span_   = span_;
+   ctl->elsize_ = elsize_;
+   ctl->first_  = first_;
+   ctl->blocks_ = elsize_*nof_elmts_;
+   ctl->ops_    = &ops_;
+   attach( ctl );
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::attach( fb_pool_control* ctl ) noexcept
+{
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   std::lock_guard<std::mutex> lock( pools_mutex_ );
+#endif
+   ctl->type_prev_ = 0;
+   ctl->type_next_ = pools_;
+   if ( pools_ != 0 )
+   {
+      pools_->type_prev_ = ctl;
+   }
+   pools_ = ctl;
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::detach( fb_pool_control* ctl ) noexcept
+{
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   std::lock_guard<std::mutex> lock( pools_mutex_ );
+#endif
+   if ( ctl->type_prev_ != 0 )
+   {
+      ctl->type_prev_->type_next_ = ctl->type_next_;
+   }
+   else
+   {
+      pools_ = ctl->type_next_;
+   }
+   if ( ctl->type_next_ != 0 )
+   {
+      ctl->type_next_->type_prev_ = ctl->type_prev_;
+   }
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::release_control( fb_pool_control* ctl ) noexcept
+{
+   ctl->ops_->detach_( ctl );
+
+   char* p = static_cast<char*>( static_cast<void*>(ctl) );
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   fb_free_controls<>::head_.push( p, p );
+#else
+   *(char**)(p)              = fb_free_controls<>::head_;
+   fb_free_controls<>::head_ = p;
+#endif
+}
+
+//
+// empty pool: no chunks, no free blocks, blocks still in use are counted as freed
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::reset_control( fb_pool_control* ctl ) noexcept
+{
+   ctl->pool_head_  = 0;
+   ctl->chunk_head_ = 0;
+   ctl->chunk_tail_ = 0;
+   ctl->bump_ptr_   = 0;
+   for( unsigned int rc = 0; rc != fb_log2(CHUNKS_MAX_RUN); ++rc )
+   {
+      ctl->run_heads_[rc] = 0;
+   }
+   ctl->frees_.set( ctl->allocs_.get() );
+   ctl->live_blocks_.set( 0 );
+   ctl->chunks_.set( 0 );
+   ctl->grow_spans_ = 1;
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   ctl->remote_head_.store( 0, std::memory_order_relaxed );
+#endif
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void 
+fb_alloc<T,nof_elements,alignment,hooks>::grow( void )
+{
+   //
+   // carve the next segment of the chunk first
+   //
+   if ( (CHUNKS_GROWTH_LIMIT > 1) && (ctl_->bump_ptr_ != 0) && (block_header( ctl_->bump_ptr_ )->nof_spans_ > 1) )
+   {
+      ctl_->bump_ptr_ = chunk_of( ctl_->bump_ptr_, ctl_->span_ ) + ctl_->span_ + ctl_->first_;
+      return;
+   }
+
+   //
+   // no links are set, blocks are carved from the new chunk one by one,
+   // only blocks given back go to the pool
+   //
+   char* start = add_chunk();
+
+   ctl_->bump_ptr_ = start + ctl_->first_;
+
+   hooks::template on_grow<T>( ctl_, start, header_of( start )->nof_spans_*ctl_->span_ );
+}
+
+//
+// take nbytes from the chunk being carved, what is left of it
+// when not enough goes to the pool of available blocks
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> char*
+fb_alloc<T,nof_elements,alignment,hooks>::carve( size_t nbytes )
+{
+   char* end = bump_end();
+   if ( static_cast<size_t>(end - ctl_->bump_ptr_) < nbytes )
+   {
+      for( char* p = ctl_->bump_ptr_; p < end; p += ctl_->elsize_ )
+      {
+         poison( p, ctl_->elsize_ );
+         link_block( p, ctl_->pool_head_ );
+         ctl_->pool_head_ = p;
+      }
+      grow();
+   }
+   char* res = ctl_->bump_ptr_;
+   ctl_->bump_ptr_ += nbytes;
+   return res;
+}
+
+//
+// free list head is empty: blocks freed by other threads are taken first,
+// then nbytes are carved
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> char*
+fb_alloc<T,nof_elements,alignment,hooks>::miss( char*& head, size_t nbytes )
+{
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   if ( drain_remote() && head != 0 )
+   {
+      char* res = head;
+      head = next_block( res );
+      claim( res, nbytes, true );
+      return res;
+   }
+#else
+   static_cast<void>( head );
+#endif
+   char* res = carve( nbytes );
+   claim( res, nbytes, false );
+   return res;
+}
+
+//
+// get new chunk and put it at the head of the chunk list
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> char*
+fb_alloc<T,nof_elements,alignment,hooks>::add_chunk( void )
+{
+   // constructor was unable to allocate control block, time to die
+   if ( ctl_ == &null_control_ )
+   {
+      throw std::bad_alloc();
+   }
+   
+   unsigned int nof_spans = ctl_->grow_spans_;
+   char*        start     = 0;
+   if ( ctl_->upstream_ != 0 )
+   {
+      start = ctl_->upstream_->allocate( nof_spans*ctl_->span_ );
+      hooks::template on_allocate_chunk<T>( start, nof_spans*ctl_->span_ );
+   }
+   else
+   {
+      start = ctl_->ops_->allocate_chunk_( nof_spans );
+   }
+
+   for( unsigned int k = 0; k != nof_spans; ++k )
+   {
+      chunk_header* hdr = header_of( start + k*ctl_->span_ );
+      hdr->next_      = 0;
+      hdr->owner_     = ctl_;
+      hdr->live_      = 0;
+      hdr->nof_spans_ = nof_spans - k;
+#ifdef CHUNKS_HARDENED
+      memset( static_cast<void*>( hdr + 1 ), 0, ctl_->first_ - sizeof(chunk_header) );
+#endif
+   }
+   if ( ctl_->chunk_head_ == 0 )
+   {
+      ctl_->chunk_tail_ = start;
+   }
+   header_of( start )->next_ = ctl_->chunk_head_;
+   ctl_->chunk_head_ = start;
+
+   if ( 2*nof_spans <= CHUNKS_GROWTH_LIMIT )
+   {
+      ctl_->grow_spans_ = 2*nof_spans;
+   }
+   ctl_->chunks_.add( nof_spans );
+   ctl_->grows_.add( 1 );
+
+   return start;
+}
+
+//
+// end of the blocks in the chunk being carved, blocks from bump_ptr_ up to it
+// are not carved yet. Blocks end before the end of the chunk, so bump_ptr_ masks
+// to its chunk even when everything is carved
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline char*
+fb_alloc<T,nof_elements,alignment,hooks>::bump_end( void ) const
+{
+   return (ctl_->bump_ptr_ != 0) ? chunk_of( ctl_->bump_ptr_, ctl_->span_ ) + ctl_->first_ + ctl_->blocks_ : 0;
+}
+
+//
+// could allocate(n) be served by the run of blocks. Every chunk holds at least nof_elements
+// blocks whatever pool geometry is, so the answer is the same for all types sharing the pool
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline bool
+fb_alloc<T,nof_elements,alignment,hooks>::pooled_run( size_t n ) const
+{
+   return (n <= CHUNKS_MAX_RUN) && ( (size_t(1) << (run_class(n) + 1)) <= nof_elements );
+}
+
+//
+// index of the run free list for n > 1 blocks: 0 for 2 blocks, 1 for 3..4 blocks etc
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline unsigned int
+fb_alloc<T,nof_elements,alignment,hooks>::run_class( size_t n )
+{
+   unsigned int rc = 0;
+   while ( (size_t(2) << rc) < n )
+   {
+      ++rc;
+   }
+   return rc;
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void 
+fb_alloc<T,nof_elements,alignment,hooks>::clean( fb_pool_control* ctl )
+{
+#ifdef CHUNKS_HARDENED
+   for( char* p = ctl->chunk_head_; p != 0; p = header_of( p )->next_ )
+   {
+      FB_ASAN_UNPOISON( p, header_of( p )->nof_spans_*ctl->span_ );
+   }
+#endif
+
+   // chunks of upstream are just forgotten
+   char* ptr = (ctl->upstream_ == 0 && !splice_chunks( ctl )) ? ctl->chunk_head_ : 0;
+   while ( ptr != 0 )
+   {
+      chunk_header* hdr = header_of( ptr );
+      FB_PREFETCH( hdr->next_ );
+      ctl->chunk_head_ = hdr->next_;
+      deallocate_chunk( ptr, hdr->nof_spans_ );
+      ptr = ctl->chunk_head_;
+   }
+   reset_control( ctl );
+}
+
+//
+// whole chunk list goes to GLOBAL list with one pointer operation (single CAS), chunks
+// are linked through their headers just as GLOBAL list is. Chunks are still given back
+// one by one if they take more than one span, could be retired above high-water mark,
+// should be traced, could belong to different NUMA nodes or are poisoned for ASan
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> bool
+fb_alloc<T,nof_elements,alignment,hooks>::splice_chunks( fb_pool_control* ctl )
+{
+#if defined(CHUNKS_RETURNED_TO_MALLOC) || (CHUNKS_GROWTH_LIMIT > 1) || (CHUNKS_NUMA_NODES > 1) || defined(FB_ASAN)
+   static_cast<void>( ctl );
+   return false;
+#else
+   int nof_chunks = static_cast<int>( ctl->chunks_.get() );
+   if ( !std::is_same<hooks, fb_no_hooks>::value || ctl->chunk_head_ == 0 ||
+        ( high_water_mark_ >= 0 && nof_free_chunks_ + nof_chunks > high_water_mark_ ) )
+   {
+      return false;
+   }
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   nof_free_chunks_ += nof_chunks;
+   global_chunk_stack_[0].push( ctl->chunk_head_, ctl->chunk_tail_ );
+#else
+   header_of( ctl->chunk_tail_ )->next_ = global_chunk_head_;
+   global_chunk_head_ = ctl->chunk_head_;
+   nof_free_chunks_  += nof_chunks;
+#endif
+   return true;
+#endif
+}
+
+//
+// chunks without live blocks are marked with zero owner, their blocks are
+// dropped from the free lists and chunks are given back
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> int
+fb_alloc<T,nof_elements,alignment,hooks>::trim( void )
+{
+   if ( ctl_->upstream_ != 0 )
+   {
+      return 0;
+   }
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   // blocks freed by other threads keep their chunks alive until they are taken back
+   drain_remote();
+#endif
+
+   int    nof_empty = 0;
+   size_t nof_spans = 0;
+   for( char* ptr = ctl_->chunk_head_; ptr != 0; ptr = header_of( ptr )->next_ )
+   {
+      FB_PREFETCH( header_of( ptr )->next_ );
+
+      //
+      // chunk goes only as a whole, all its segments should be empty
+      //
+      unsigned int n    = header_of( ptr )->nof_spans_;
+      unsigned int live = 0;
+      for( unsigned int k = 0; k != n; ++k )
+      {
+         live += header_of( ptr + k*ctl_->span_ )->live_;
+      }
+      if ( live == 0 )
+      {
+         for( unsigned int k = 0; k != n; ++k )
+         {
+            header_of( ptr + k*ctl_->span_ )->owner_ = 0;
+         }
+         ++nof_empty;
+         nof_spans += n;
+      }
+   }
+   if ( nof_empty == 0 )
+   {
+      return 0;
+   }
+
+   ctl_->chunks_.sub( nof_spans );
+
+   ctl_->pool_head_ = unlink_empty( ctl_->pool_head_ );
+   for( unsigned int rc = 0; rc != fb_log2(CHUNKS_MAX_RUN); ++rc )
+   {
+      ctl_->run_heads_[rc] = unlink_empty( ctl_->run_heads_[rc] );
+   }
+   if ( (ctl_->bump_ptr_ != 0) && (block_header( ctl_->bump_ptr_ )->owner_ == 0) )
+   {
+      ctl_->bump_ptr_ = 0;
+   }
+
+   char** link = &ctl_->chunk_head_;
+   ctl_->chunk_tail_ = 0;
+   while ( *link != 0 )
+   {
+      char*         ptr = *link;
+      chunk_header* hdr = header_of( ptr );
+      if ( hdr->owner_ == 0 )
+      {
+         *link = hdr->next_;
+         FB_ASAN_UNPOISON( ptr, hdr->nof_spans_*ctl_->span_ );
+         ctl_->ops_->deallocate_chunk_( ptr, hdr->nof_spans_ );
+      }
+      else
+      {
+         ctl_->chunk_tail_ = ptr;
+         link = &hdr->next_;
+      }
+   }
+   return nof_empty;
+}
+
+//
+// drop from the free list all blocks which belong to chunks being trimmed
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> char*
+fb_alloc<T,nof_elements,alignment,hooks>::unlink_empty( char* head ) const
+{
+   char* res  = head;
+   char* prev = 0;
+   for( char* p = head; p != 0; )
+   {
+      char* next = decode_link( p );
+      if ( block_header( p )->owner_ != 0 )
+      {
+         prev = p;
+      }
+      else if ( prev != 0 )
+      {
+         link_block( prev, next );
+      }
+      else
+      {
+         res = next;
+      }
+      p = next;
+   }
+   return res;
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::set_high_water_mark( int nof_chunks, fb_trim_mode mode )
+{
+   high_water_mark_ = nof_chunks;
+   trim_mode_       = mode;
+}
+
+//
+// chunk is about to be put into GLOBAL list which already has nof_free chunks.
+// Above high-water mark the chunk is either freed (returns true, chunk is gone) or its
+// pages are given back to OS. First page is kept, it holds the link in GLOBAL list.
+// With CHUNKS_SHARED_BETWEEN_THREADS chunk could have been on the lock-free stack and
+// pop() in flight on another thread may still read its link, so it is never freed
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> bool
+fb_alloc<T,nof_elements,alignment,hooks>::retire_chunk( char* p, int nof_free )
+{
+   if ( high_water_mark_ < 0 || nof_free < high_water_mark_ )
+   {
+      return false;
+   }
+
+#ifndef CHUNKS_SHARED_BETWEEN_THREADS
+   if ( trim_mode_ == FB_TRIM_RELEASE )
+   {
+      --nof_allocated_chunks_;
+      released_chunks_.add( 1 );
+      provider()->deallocate( p, span_ );
+      return true;
+   }
+#endif
+
+#ifndef _WIN32
+   static const size_t page = static_cast<size_t>( sysconf(_SC_PAGESIZE) );
+   if ( span_ > page )
+   {
+      madvise( p + page, span_ - page, MADV_DONTNEED );
+   }
+#endif
+   return false;
+}
+
+//
+// chunks are not carved, their blocks are linked into the free list from the last one,
+// so they are handed out in address order
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::reserve( size_t nof_blocks, bool lock )
+{
+   for( size_t reserved = 0; reserved < nof_blocks; )
+   {
+      char*        start     = add_chunk();
+      unsigned int nof_spans = header_of( start )->nof_spans_;
+      if ( lock )
+      {
+         fb_prefault_pages( start, nof_spans*ctl_->span_, true );
+      }
+
+      for( unsigned int k = nof_spans; k-- != 0; )
+      {
+         char* first = start + k*ctl_->span_ + ctl_->first_;
+         for( char* p = first + ctl_->blocks_; p != first; )
+         {
+            p -= ctl_->elsize_;
+            poison( p, ctl_->elsize_ );
+            link_block( p, ctl_->pool_head_ );
+            ctl_->pool_head_ = p;
+         }
+      }
+      reserved += nof_spans*(ctl_->blocks_/ctl_->elsize_);
+
+      hooks::template on_grow<T>( ctl_, start, nof_spans*ctl_->span_ );
+   }
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> int
+fb_alloc<T,nof_elements,alignment,hooks>::prefault( int nof_chunks, bool lock )
+{
+#ifdef CHUNKS_RETURNED_TO_MALLOC
+   static_cast<void>( nof_chunks );
+   static_cast<void>( lock );
+   return 0;
+#else
+   int nn = 0;
+   for( ; nn < nof_chunks; ++nn )
+   {
+      if ( high_water_mark_ >= 0 && nof_free_chunks_ >= high_water_mark_ )
+      {
+         break;
+      }
+
+      char* p = 0;
+      try
+      {
+         p = provider()->allocate( span_ );
+      }
+      catch( const std::bad_alloc& )
+      {
+         break;
+      }
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      unsigned int node = thread_node( magazine_ );
+#if CHUNKS_NUMA_NODES > 1
+      fb_numa_bind( p, span_, node );
+      header_of( p )->node_ = node;
+#endif
+#endif
+      fb_prefault_pages( p, span_, lock );
+      ++nof_allocated_chunks_;
+      provider_chunks_.add( 1 );
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      ++nof_free_chunks_;
+      global_chunk_stack_[node].push( p, p );
+#else
+      alloc_link* ptr    = static_cast<alloc_link*>( static_cast<void*>(p) );
+      ptr->next_         = static_cast<alloc_link*>( static_cast<void*>(global_chunk_head_) );
+      global_chunk_head_ = p;
+      ++nof_free_chunks_;
+#endif
+   }
+   return nn;
+#endif
+}
+
+//
+// O(1): owning chunk is found by masking, block should sit on the block boundary
+// inside the chunk, and the chunk should belong to our pool.
+// NB: p is expected to be some heap pointer, masking arbitrary address
+// could land on the unmapped memory
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline bool
+fb_alloc<T,nof_elements,alignment,hooks>::check( const pointer p ) const
+{
+   char*  pob   = static_cast<char*>( static_cast<void*>(p) );
+   char*  chunk = chunk_of( pob, ctl_->span_ );
+   size_t ofs   = static_cast<size_t>( pob - chunk );
+
+   if ( ofs < ctl_->first_ || ((ofs - ctl_->first_) % ctl_->elsize_) != 0 || ofs - ctl_->first_ >= ctl_->blocks_ )
+   {
+      return false;
+   }
+   return header_of( chunk )->owner_ == ctl_;
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline
+typename fb_alloc<T,nof_elements,alignment,hooks>::chunk_header*
+fb_alloc<T,nof_elements,alignment,hooks>::header_of( char* chunk )
+{
+   return static_cast<chunk_header*>( static_cast<void*>( chunk ) );
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline char*
+fb_alloc<T,nof_elements,alignment,hooks>::chunk_of( const void* p, size_t span )
+{
+   return reinterpret_cast<char*>( reinterpret_cast<uintptr_t>(p) & ~static_cast<uintptr_t>(span - 1) );
+}
+
+//
+// header of the chunk of our pool which holds p, pool geometry could differ from ours
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline
+typename fb_alloc<T,nof_elements,alignment,hooks>::chunk_header*
+fb_alloc<T,nof_elements,alignment,hooks>::block_header( const void* p ) const
+{
+   return header_of( chunk_of( p, ctl_->span_ ) );
+}
+
+//
+// link of the free block p. Hardened mode: the link should point to the block of our pool,
+// otherwise the block was written after it was freed
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline char*
+fb_alloc<T,nof_elements,alignment,hooks>::next_block( char* p ) const
+{
+   char* next = decode_link( p );
+#ifdef CHUNKS_HARDENED
+   if ( next != 0 && !check( static_cast<pointer>( static_cast<void*>(next) ) ) )
+   {
+      fb_hardening_failure( "free list is corrupted (write after free?)", p );
+   }
+#endif
+   return next;
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline char*
+fb_alloc<T,nof_elements,alignment,hooks>::decode_link( char* p )
+{
+   alloc_link* link = static_cast<alloc_link*>( static_cast<void*>(p) );
+#ifdef CHUNKS_HARDENED
+   return reinterpret_cast<char*>( reinterpret_cast<uintptr_t>(link->next_) ^ fb_link_key() ^ reinterpret_cast<uintptr_t>(p) );
+#else
+   return static_cast<char*>( static_cast<void*>(link->next_) );
+#endif
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::link_block( char* p, char* next )
+{
+   alloc_link* link = static_cast<alloc_link*>( static_cast<void*>(p) );
+#ifdef CHUNKS_HARDENED
+   link->next_ = reinterpret_cast<alloc_link*>( reinterpret_cast<uintptr_t>(next) ^ fb_link_key() ^ reinterpret_cast<uintptr_t>(p) );
+#else
+   link->next_ = static_cast<alloc_link*>( static_cast<void*>(next) );
+#endif
+}
+
+//
+// hardened mode: bit of the block in the bitmap which follows the chunk header is set
+// while the block is allocated. Threads freeing blocks to the remote list clear bits
+// as well, so in concurrent mode bitmap words are updated atomically
+//
+#ifdef CHUNKS_HARDENED
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline uint64_t*
+fb_alloc<T,nof_elements,alignment,hooks>::bitmap_word( char* p, uint64_t& bit ) const
+{
+   char*  seg = chunk_of( p, ctl_->span_ );
+   size_t idx = static_cast<size_t>( p - seg - ctl_->first_ )/ctl_->elsize_;
+   bit = uint64_t(1) << (idx % 64);
+   return static_cast<uint64_t*>( static_cast<void*>( header_of( seg ) + 1 ) ) + idx/64;
+}
+#endif
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::claim( char* p, size_t nbytes, bool recycled ) const
+{
+#ifdef CHUNKS_HARDENED
+   if ( recycled )
+   {
+      FB_ASAN_UNPOISON( p + sizeof(alloc_link), nbytes - sizeof(alloc_link) );
+      for( size_t k = sizeof(alloc_link); k != nbytes; ++k )
+      {
+         if ( static_cast<unsigned char>( p[k] ) != FB_POISON_BYTE )
+         {
+            fb_hardening_failure( "free block was written after it was freed", p );
+         }
+      }
+   }
+
+   uint64_t  bit  = 0;
+   uint64_t* word = bitmap_word( p, bit );
+#if defined(CHUNKS_SHARED_BETWEEN_THREADS) && (defined(__GNUC__) || defined(__clang__))
+   uint64_t  old  = __atomic_fetch_or( word, bit, __ATOMIC_RELAXED );
+#else
+   uint64_t  old  = *word;
+   *word = old | bit;
+#endif
+   if ( old & bit )
+   {
+      fb_hardening_failure( "block is handed out twice, free list is corrupted", p );
+   }
+#else
+   static_cast<void>( p );
+   static_cast<void>( nbytes );
+   static_cast<void>( recycled );
+#endif
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::unmark( char* p ) const
+{
+#ifdef CHUNKS_HARDENED
+   if ( !check( static_cast<pointer>( static_cast<void*>(p) ) ) )
+   {
+      fb_hardening_failure( "block does not belong to the pool", p );
+   }
+
+   uint64_t  bit  = 0;
+   uint64_t* word = bitmap_word( p, bit );
+#if defined(CHUNKS_SHARED_BETWEEN_THREADS) && (defined(__GNUC__) || defined(__clang__))
+   uint64_t  old  = __atomic_fetch_and( word, ~bit, __ATOMIC_RELAXED );
+#else
+   uint64_t  old  = *word;
+   *word = old & ~bit;
+#endif
+   if ( !(old & bit) )
+   {
+      fb_hardening_failure( "double free", p );
+   }
+#else
+   static_cast<void>( p );
+#endif
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::poison( char* p, size_t nbytes ) const
+{
+#ifdef CHUNKS_HARDENED
+   memset( p + sizeof(alloc_link), FB_POISON_BYTE, nbytes - sizeof(alloc_link) );
+   FB_ASAN_POISON( p + sizeof(alloc_link), nbytes - sizeof(alloc_link) );
+#else
+   static_cast<void>( p );
+   static_cast<void>( nbytes );
+#endif
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::set_provider( fb_chunk_provider* provider )
+{
+   provider_ = provider;
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline fb_chunk_provider*
+fb_alloc<T,nof_elements,alignment,hooks>::provider( void )
+{
+   return (provider_ != 0) ? provider_ : &fb_heap_provider::instance();
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline char*
+fb_alloc<T,nof_elements,alignment,hooks>::allocate_chunk( unsigned int nof_spans )
+{
+   //
+   // large chunks are not kept in GLOBAL list
+   //
+   if ( (CHUNKS_GROWTH_LIMIT > 1) && (nof_spans > 1) )
+   {
+      char* res = provider()->allocate( nof_spans*span_ );
+      provider_chunks_.add( nof_spans );
+      hooks::template on_allocate_chunk<T>( res, nof_spans*span_ );
+      return res;
+   }
+
+#ifdef CHUNKS_RETURNED_TO_MALLOC
+   char* res = provider()->allocate( span_ );
+   provider_chunks_.add( 1 );
+   hooks::template on_allocate_chunk<T>( res, span_ );
+   return res;
+#elif defined(CHUNKS_SHARED_BETWEEN_THREADS)
+   //
+   // take chunk from the thread local magazine, GLOBAL list is touched
+   // only when magazine is empty and then for the whole batch of chunks
+   //
+   chunk_magazine& mag = magazine_;
+   if ( mag.head_ == 0 )
+   {
+      refill_magazine( mag );
+      if ( mag.head_ == 0 ) // no more preallocated chunks, ask malloc nicely for additional chunk
+      {
+         return fresh_chunk( mag );
+      }
+   }
+   depot_chunks_.add( 1 );
+
+   --mag.count_;
+   assert( mag.count_ >= 0 );
+   char* res = mag.head_;
+   mag.head_ = static_cast<char*>(static_cast<void*>( static_cast<alloc_link*>(static_cast<void*>(res))->next_ ));
+
+   hooks::template on_allocate_chunk<T>( res, span_ );
+   return res;
+#else
+   if ( global_chunk_head_ == 0 ) // no more preallocated chunks, ask malloc nicely for additional chunk
+   {
+      char* res = provider()->allocate( span_ );
+      ++nof_allocated_chunks_;
+      provider_chunks_.add( 1 );
+      hooks::template on_allocate_chunk<T>( res, span_ );
+      return res;
+   }
+   depot_chunks_.add( 1 );
+
+   //
+   // chunks are available, return one from the pool
+   //
+   --nof_free_chunks_;
+   assert( nof_free_chunks_ >= 0 );
+   char* res          = global_chunk_head_;
+   global_chunk_head_ = static_cast<char*>(static_cast<void*>( static_cast<alloc_link*>(static_cast<void*>(res))->next_ ));
+
+   hooks::template on_allocate_chunk<T>( res, span_ );
+   return res;
+#endif
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::deallocate_chunk( char* p, unsigned int nof_spans )
+{
+   hooks::template on_deallocate_chunk<T>( p, nof_spans*span_ );
+
+   if ( (CHUNKS_GROWTH_LIMIT > 1) && (nof_spans > 1) )
+   {
+      released_chunks_.add( nof_spans );
+      provider()->deallocate( p, nof_spans*span_ );
+      return;
+   }
+
+#ifdef CHUNKS_RETURNED_TO_MALLOC
+   released_chunks_.add( 1 );
+   provider()->deallocate( p, span_ );
+#elif defined(CHUNKS_SHARED_BETWEEN_THREADS)
+   //
+   // keep chunk in the thread local magazine, when it overflows
+   // hand half of the magazine back to the GLOBAL list in one go
+   //
+   chunk_magazine& mag = magazine_;
+
+#if CHUNKS_NUMA_NODES > 1
+   //
+   // chunk of another node goes straight home
+   //
+   unsigned int node = chunk_node( p );
+   if ( node != thread_node( mag ) )
+   {
+      if ( !retire_chunk( p, nof_free_chunks_ ) )
+      {
+         ++nof_free_chunks_;
+         global_chunk_stack_[node].push( p, p );
+      }
+      return;
+   }
+#endif
+
+   alloc_link* ptr = static_cast<alloc_link*>( static_cast<void*>(p) );
+   ptr->next_      = static_cast<alloc_link*>( static_cast<void*>(mag.head_) );
+   mag.head_       = static_cast<char*>( static_cast<void*>(ptr) );
+   ++mag.count_;
+
+   if ( mag.count_ > CHUNKS_MAGAZINE_SIZE )
+   {
+      flush_magazine( mag, mag.count_/2 );
+   }
+#else
+   //
+   // instead of returning memory to malloc/OS,
+   // keep global linked list of chunks for future requests
+   //
+   if ( retire_chunk( p, nof_free_chunks_ ) )
+   {
+      return;
+   }
+
+//    std::cerr << "D: ";
+
+   alloc_link* ptr    = static_cast<alloc_link*>( static_cast<void*>(p) );
+   ptr->next_         = static_cast<alloc_link*>( static_cast<void*>(global_chunk_head_) );
+   global_chunk_head_ = static_cast<char*>( static_cast<void*>(ptr) );
+   ++nof_free_chunks_;
+
+//    std::cerr << nof_free_chunks_ << std::endl;   
+
+   assert( nof_free_chunks_ <= nof_allocated_chunks_ );
+
+#endif
+}
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+//
+// move up to half a magazine of chunks from the GLOBAL stack of our node into mag,
+// chunks are popped one by one, so each of them costs single CAS. Thread could have
+// moved to another node meanwhile, so the node is asked for again
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::refill_magazine( chunk_magazine& mag )
+{
+   int nof_chunks = ( CHUNKS_MAGAZINE_SIZE + 1 )/2;
+
+   mag.node_ = 0;
+   fb_chunk_stack& depot = global_chunk_stack_[ thread_node( mag ) ];
+   for( int nn = 0; nn < nof_chunks; ++nn )
+   {
+      char* p = depot.pop();
+      if ( p == 0 )
+      {
+         break;
+      }
+      --nof_free_chunks_;
+      assert( nof_free_chunks_ >= 0 );
+
+      alloc_link* ptr = static_cast<alloc_link*>( static_cast<void*>(p) );
+      ptr->next_      = static_cast<alloc_link*>( static_cast<void*>(mag.head_) );
+      mag.head_       = p;
+      ++mag.count_;
+   }
+}
+
+//
+// hand nof_chunks chunks from the head of mag back to the GLOBAL stack,
+// chunks above high-water mark are retired, the rest is linked
+// into the batch and pushed with one CAS
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::flush_magazine( chunk_magazine& mag, int nof_chunks )
+{
+   assert( nof_chunks <= mag.count_ );
+
+   char*        head  = 0;
+   char*        tail  = 0;
+   int          nkept = 0;
+   unsigned int node  = thread_node( mag );
+   for( int nn = 0; nn < nof_chunks; ++nn )
+   {
+      char* p   = mag.head_;
+      mag.head_ = static_cast<char*>( static_cast<void*>( static_cast<alloc_link*>(static_cast<void*>(p))->next_ ) );
+      --mag.count_;
+
+      if ( retire_chunk( p, nof_free_chunks_ + nkept ) )
+      {
+         continue;
+      }
+
+      //
+      // chunk taken before the thread moved to another node
+      //
+      if ( chunk_node( p ) != node )
+      {
+         ++nof_free_chunks_;
+         global_chunk_stack_[ chunk_node( p ) ].push( p, p );
+         continue;
+      }
+
+      static_cast<alloc_link*>(static_cast<void*>(p))->next_ = static_cast<alloc_link*>( static_cast<void*>(head) );
+      head = p;
+      if ( tail == 0 )
+      {
+         tail = p;
+      }
+      ++nkept;
+   }
+   if ( nkept == 0 )
+   {
+      return;
+   }
+
+   // counted before push, so concurrent pop never sees counter below zero
+   nof_free_chunks_ += nkept;
+   assert( nof_free_chunks_ <= nof_allocated_chunks_ );
+
+   global_chunk_stack_[node].push( head, tail );
+}
+
+//
+// no free chunks on our node: new chunk bound to our node. Chunks of other
+// nodes are taken only if provider fails
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> char*
+fb_alloc<T,nof_elements,alignment,hooks>::fresh_chunk( chunk_magazine& mag )
+{
+   unsigned int node = thread_node( mag );
+   char*        res  = 0;
+   try
+   {
+      res = provider()->allocate( span_ );
+   }
+   catch( const std::bad_alloc& )
+   {
+      for( unsigned int k = 1; k < CHUNKS_NUMA_NODES; ++k )
+      {
+         res = global_chunk_stack_[ (node + k) % CHUNKS_NUMA_NODES ].pop();
+         if ( res != 0 )
+         {
+            --nof_free_chunks_;
+            depot_chunks_.add( 1 );
+            hooks::template on_allocate_chunk<T>( res, span_ );
+            return res;
+         }
+      }
+      throw;
+   }
+
+#if CHUNKS_NUMA_NODES > 1
+   fb_numa_bind( res, span_, node );
+   header_of( res )->node_ = node;
+#endif
+
+   ++nof_allocated_chunks_;
+   provider_chunks_.add( 1 );
+   hooks::template on_allocate_chunk<T>( res, span_ );
+   return res;
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline unsigned int
+fb_alloc<T,nof_elements,alignment,hooks>::thread_node( chunk_magazine& mag )
+{
+#if CHUNKS_NUMA_NODES > 1
+   if ( mag.node_ == 0 )
+   {
+      mag.node_ = fb_numa_node() + 1;
+   }
+   return mag.node_ - 1;
+#else
+   static_cast<void>( mag );
+   return 0;
+#endif
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline unsigned int
+fb_alloc<T,nof_elements,alignment,hooks>::chunk_node( char* chunk )
+{
+#if CHUNKS_NUMA_NODES > 1
+   return header_of( chunk )->node_;
+#else
+   static_cast<void>( chunk );
+   return 0;
+#endif
+}
+
+//
+// thread is going away, give all cached chunks back to the GLOBAL list
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>
+fb_alloc<T,nof_elements,alignment,hooks>::chunk_magazine::~chunk_magazine( void )
+{
+   flush_magazine( *this, count_ );
+}
+#endif
+
+//
+// entry points only pass the call site on, when there are hooks to take it
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> FB_ALWAYS_INLINE
+typename fb_alloc<T,nof_elements,alignment,hooks>::pointer
+fb_alloc<T,nof_elements,alignment,hooks>::allocate( size_type n, const void* )
+{
+   return allocate_at( n, std::is_same<hooks, fb_no_hooks>::value ? 0 : call_site() );
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> FB_ALWAYS_INLINE void
+fb_alloc<T,nof_elements,alignment,hooks>::deallocate( pointer p, size_type n )
+{
+   deallocate_at( p, n, std::is_same<hooks, fb_no_hooks>::value ? 0 : call_site() );
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> FB_ALWAYS_INLINE void
+fb_alloc<T,nof_elements,alignment,hooks>::allocate_n( pointer* ptrs, size_t count )
+{
+   allocate_n_at( ptrs, count, std::is_same<hooks, fb_no_hooks>::value ? 0 : call_site() );
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> FB_ALWAYS_INLINE void
+fb_alloc<T,nof_elements,alignment,hooks>::deallocate_n( pointer* ptrs, size_t count )
+{
+   deallocate_n_at( ptrs, count, std::is_same<hooks, fb_no_hooks>::value ? 0 : call_site() );
+}
 
-   private:
+//
+// return address of this function is in the code which called the entry point
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> FB_NOINLINE const void*
+fb_alloc<T,nof_elements,alignment,hooks>::call_site( void )
+{
+   return FB_CALL_SITE();
+}
 
-      struct alloc_link
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline
+typename fb_alloc<T,nof_elements,alignment,hooks>::pointer
+fb_alloc<T,nof_elements,alignment,hooks>::allocate_at( size_type n, const void* site )
+{
+   if ( n == 1 )
+   {      
+      char* res = ctl_->pool_head_;
+      if ( res != 0 )
       {
-         struct alloc_link* next_;
-      };
-
-      unsigned int  nof_elmts_; // number of elements in one chunk
-      size_t        elsize_;    // element size adjusted due to alignment restrictions
-      size_t        alignment_; // alignment value
+         ctl_->pool_head_ = next_block( res );
+         claim( res, ctl_->elsize_, true );
+      }
+      else
+      {
+         res = miss( ctl_->pool_head_, ctl_->elsize_ );
+      }
+      ++block_header( res )->live_;
       
-      char*         pool_head_;  // head of the pool of available blocks
-      char*         chunk_head_; // head of the chunk list
+      count_alloc( 1, 1 );
 
-      int*          refcount_;   // pointer to the reference counter which protects chunk list
-      int*          nof_allocs_; // number of elements allocations
-
-      static char*  global_chunk_head_;    // head of the GLOBAL chunk list
-      static int    nof_allocated_chunks_; // number of allocated chunks kept in global list
-      static int    nof_free_chunks_;      // number of free chunks in global list
-};
+      hooks::template on_allocate<T>( ctl_, res, 1, site );
+      return static_cast<pointer>(static_cast<void*>(res));
+   }
 
-template <typename T, unsigned int nof_elements, size_t alignment>  char*
-fb_alloc<T,nof_elements,alignment>::global_chunk_head_ = 0;
+   if ( pooled_run(n) )
+   {
+      unsigned int rc  = run_class( n );
+      char*        res = ctl_->run_heads_[rc];
+      if ( res != 0 )
+      {
+         ctl_->run_heads_[rc] = next_block( res );
+         claim( res, ctl_->elsize_ << (rc + 1), true );
+      }
+      else
+      {
+         res = miss( ctl_->run_heads_[rc], ctl_->elsize_ << (rc + 1) );
+      }
+      ++block_header( res )->live_;
 
-template <typename T, unsigned int nof_elements, size_t alignment>  int
-fb_alloc<T,nof_elements,alignment>::nof_allocated_chunks_ = 0;
+      count_alloc( 1, size_t(2) << rc );
 
-template <typename T, unsigned int nof_elements, size_t alignment>  int
-fb_alloc<T,nof_elements,alignment>::nof_free_chunks_ = 0;
+      hooks::template on_allocate<T>( ctl_, res, n, site );
+      return static_cast<pointer>(static_cast<void*>(res));
+   }
 
-template <typename T, unsigned int nof_elements, size_t alignment> 
-fb_alloc<T,nof_elements,alignment>::fb_alloc( void ) throw ():
+   pointer res = static_cast<pointer>( ::operator new (n*sizeof(T)) );
+   hooks::template on_allocate<T>( ctl_, res, n, site );
+   return res;
+}
 
-   nof_elmts_(nof_elements),
-   elsize_(sizeof(T)),
-   alignment_(alignment),
-   pool_head_(0),
-   chunk_head_(0)
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::deallocate_at( pointer p, size_type n, const void* site )
 {
+   hooks::template on_deallocate<T>( ctl_, p, n, site );
 
-   assert( nof_elmts_ > 0 );
-   assert( elsize_ > 0 );
-   assert( alignment_ > 0 );
-
-   //
-   // calculate proper element size taking into account alignment
-   //
-   for( ; elsize_ < elsize_ + alignment_; ++elsize_ )
+   if ( n == 1 )
    {
-      if ( (elsize_ % alignment_ ) == 0 )
+      //
+      // check in p is allocated by us: O(1), see check()
+      //
+      assert( check(p) );
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      if ( !owned() )
       {
-         break;
+         unmark( static_cast<char*>( static_cast<void*>(p) ) );
+         static_cast<remote_link*>( static_cast<void*>(p) )->next_ = 0;
+         push_remote( static_cast<char*>( static_cast<void*>(p) ), static_cast<char*>( static_cast<void*>(p) ) );
+         return;
       }
+#endif
+      
+      char* ptr = static_cast<char*>( static_cast<void*>(p) );
+      unmark( ptr );
+      poison( ptr, ctl_->elsize_ );
+      link_block( ptr, ctl_->pool_head_ );
+      ctl_->pool_head_ = ptr;
+      --block_header( ptr )->live_;
+      count_free( 1, 1 );
    }
+   else if ( pooled_run(n) )
+   {
+      assert( check(p) );
 
-   //
-   // allocating refcount
-   //
-
-   // refcount_ = new (std::nothrow) int;
-   refcount_ = new int;
-   *refcount_ = 1;
-
-   // nof_allocs_ = new (std::nothrow) int;
-   nof_allocs_ = new int;
-   *nof_allocs_ = 0;
-
+      unsigned int rc = run_class( n );
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      if ( !owned() )
+      {
+         unmark( static_cast<char*>( static_cast<void*>(p) ) );
+         remote_link* rl = static_cast<remote_link*>( static_cast<void*>(p) );
+         rl->next_      = 1;
+         rl->run_class_ = rc;
+         push_remote( static_cast<char*>( static_cast<void*>(p) ), static_cast<char*>( static_cast<void*>(p) ) );
+         return;
+      }
+#endif
+      char* ptr = static_cast<char*>( static_cast<void*>(p) );
+      unmark( ptr );
+      poison( ptr, ctl_->elsize_ << (rc + 1) );
+      link_block( ptr, ctl_->run_heads_[rc] );
+      ctl_->run_heads_[rc] = ptr;
+      --block_header( ptr )->live_;
+      count_free( 1, size_t(2) << rc );
+   }
+   else
+   {
+      ::operator delete ( p );
+   }
 }
 
-//
-// copy constructor, supposed to be member template
-//
-template <typename T, unsigned int nof_elements, size_t alignment> template <typename U> 
-fb_alloc<T,nof_elements,alignment>::fb_alloc( const fb_alloc<U,nof_elements,alignment>& fba ) throw ():
-   nof_elmts_( nof_elements ),
-   elsize_( sizeof(T) ),
-   alignment_( alignment ),
-   pool_head_(0),
-   chunk_head_(0)
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::allocate_n_at( pointer* ptrs, size_t count, const void* site )
 {
-   assert( nof_elmts_ > 0 );
-   assert( elsize_ > 0 );
-   assert( alignment_ > 0 );
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   drain_remote();
+#endif
 
    //
-   // calculate proper element size taking into account alignment
+   // free list is walked once and cut after the last block taken
    //
-   for( ; elsize_ < elsize_ + alignment_; ++elsize_ )
+   size_t k   = 0;
+   char*  res = ctl_->pool_head_;
+   for( ; k != count && res != 0; ++k )
    {
-      if ( (elsize_ % alignment_ ) == 0 )
-      {
-         break;
-      }
+      char* next = next_block( res );
+      claim( res, ctl_->elsize_, true );
+      ++block_header( res )->live_;
+      ptrs[k] = static_cast<pointer>(static_cast<void*>(res));
+      res     = next;
    }
+   ctl_->pool_head_ = res;
 
    //
-   // Share internal data iff element size is the same.
-   // Actually we could share data if this->elsize_ <= fba.elsize_, 
-   // or better yet if this->elsize_ <= fba.elsize_ and this->elsize_ >= fba.elsize_/2
-   // TBD: Optimal sharing
+   // whatever is left of the chunk being carved goes in one run,
+   // then whole new chunks
    //
-   if ( elsize_ == fba.elsize_ )
-   {
-      pool_head_  = fba.pool_head_;
-      chunk_head_ = fba.chunk_head_;
-      refcount_   = fba.refcount_;
-      nof_allocs_ = fba.nof_allocs_;
-      ++*refcount_;
-      assert( *refcount_ >= 0 );
-   }
-   else
+   try
    {
-      refcount_ = new (std::nothrow) int;
-      if ( refcount_ != 0 )
+      while ( k != count )
       {
-         *refcount_ = 1;
-      }
-      nof_allocs_ = new (std::nothrow) int;
-      if ( nof_allocs_ != 0 )
-      {
-         *nof_allocs_ = 0;
+         char* end = bump_end();
+         if ( ctl_->bump_ptr_ == end )
+         {
+            grow();
+            end = bump_end();
+         }
+
+         size_t nn = static_cast<size_t>( end - ctl_->bump_ptr_ )/ctl_->elsize_;
+         if ( nn > count - k )
+         {
+            nn = count - k;
+         }
+         block_header( ctl_->bump_ptr_ )->live_ += static_cast<unsigned int>( nn );
+         for( size_t j = 0; j != nn; ++j, ++k )
+         {
+            claim( ctl_->bump_ptr_, ctl_->elsize_, false );
+            ptrs[k] = static_cast<pointer>(static_cast<void*>(ctl_->bump_ptr_));
+            ctl_->bump_ptr_ += ctl_->elsize_;
+         }
       }
    }
+   catch( const std::bad_alloc& )
+   {
+      // blocks were neither counted nor reported to hooks, they go back silently
+      free_blocks( ptrs, k );
+      throw;
+   }
+
+   count_alloc( count, count );
+
+   for( size_t j = 0; j != count; ++j )
+   {
+      hooks::template on_allocate<T>( ctl_, ptrs[j], 1, site );
+   }
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment>
-fb_alloc<T,nof_elements,alignment>::~fb_alloc( void ) throw ()
+//
+// blocks are linked in the order given and the whole batch is spliced
+// into the free list at once
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::deallocate_n_at( pointer* ptrs, size_t count, const void* site )
 {
-   if ( refcount_ != 0 )
+   if ( count == 0 )
+   {
+      return;
+   }
+
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   if ( !owned() )
    {
-      --(*refcount_);
-      assert( *refcount_ >= 0 );
-      if ( *refcount_ == 0 )
+      for( size_t k = 0; k != count; ++k )
       {
-         clean();
-         delete refcount_; refcount_ = 0;
-         delete nof_allocs_; nof_allocs_ = 0;
+         hooks::template on_deallocate<T>( ctl_, ptrs[k], 1, site );
+         assert( check(ptrs[k]) );
+
+         unmark( static_cast<char*>( static_cast<void*>(ptrs[k]) ) );
+         static_cast<remote_link*>( static_cast<void*>(ptrs[k]) )->next_ =
+            (k + 1 != count) ? reinterpret_cast<uintptr_t>( ptrs[k + 1] ) : 0;
       }
+      push_remote( static_cast<char*>( static_cast<void*>(ptrs[0]) ), static_cast<char*>( static_cast<void*>(ptrs[count - 1]) ) );
+      return;
+   }
+#endif
+
+   for( size_t k = 0; k != count; ++k )
+   {
+      hooks::template on_deallocate<T>( ctl_, ptrs[k], 1, site );
    }
+   free_blocks( ptrs, count );
+
+   count_free( count, count );
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> void 
-fb_alloc<T,nof_elements,alignment>::release( void ) throw (const char*)
+//
+// link blocks in the order given and splice them into the free list,
+// neither hooks nor counters are told
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::free_blocks( pointer* ptrs, size_t count )
 {
-   if ( refcount_ != 0 )
+   if ( count == 0 )
    {
-      --(*refcount_);
-      assert( *refcount_ >= 0 );
-      if ( *refcount_ == 0 )
-      {
-         clean(); // this delete all memory blocks
-         *refcount_   = 1;
-         *nof_allocs_ = 0;
-      }
+      return;
+   }
+
+   for( size_t k = 0; k != count; ++k )
+   {
+      assert( check(ptrs[k]) );
+
+      char* ptr = static_cast<char*>( static_cast<void*>(ptrs[k]) );
+      unmark( ptr );
+      poison( ptr, ctl_->elsize_ );
+      link_block( ptr, (k + 1 != count) ? static_cast<char*>( static_cast<void*>(ptrs[k + 1]) ) : ctl_->pool_head_ );
+      --block_header( ptr )->live_;
    }
+   ctl_->pool_head_ = static_cast<char*>( static_cast<void*>(ptrs[0]) );
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> void 
-fb_alloc<T,nof_elements,alignment>::grow( void ) throw (const std::bad_alloc&)
+//
+// counters have single writer, the thread using the pool
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::count_alloc( size_t nof_allocs, size_t nof_blocks )
 {
-   char* p;
-   
-   // constructor was unable to allocate refcount or nof_allocs_, time to die
-   if ( (refcount_ == 0) || ( nof_allocs_ == 0 ) )
+   ctl_->allocs_.add( nof_allocs );
+
+   uint64_t live = ctl_->live_blocks_.get() + nof_blocks;
+   ctl_->live_blocks_.set( live );
+   if ( live > ctl_->peak_blocks_.get() )
    {
-      throw std::bad_alloc();
+      ctl_->peak_blocks_.set( live );
    }
-   
-   char* start = allocate_chunk();
+}
 
-   *(char**)(start + elsize_*nof_elmts_) = *(char**)(&chunk_head_); // memcpy( start + elsize_*nof_elmts_, &chunk_head_, sizeof(char*) );
-   chunk_head_ = start;
-  
-   //
-   // set links
-   //
-#if 0
-   char* last  = start + (nof_elmts_-1)*elsize_;
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::count_free( size_t nof_frees, size_t nof_blocks )
+{
+   assert( ctl_->live_blocks_.get() >= nof_blocks );
+
+   ctl_->frees_.add( nof_frees );
+   ctl_->live_blocks_.sub( nof_blocks );
+}
 
-   for( p = start; p < last; p += elsize_ )
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::own( void )
+{
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   // null control block is not in a ring, it has no pools to own
+   if ( ctl_ == &null_control_ )
    {
-      ( (alloc_link*)(p) )->next_ = (alloc_link*)( p + elsize_ );
+      return;
    }
 
-   static_cast<alloc_link*>( (void*)last )->next_ = 0;
-#else
-   p = start;
-   int nn = ((nof_elmts_-1) + 7 )/8;
-   switch ( (nof_elmts_-1) % 8)
+   std::lock_guard<std::mutex> lock( fb_family_mutex<>::mutex_ );
+   fb_pool_control* ctl = ctl_;
+   do
    {
-      case 0:
-         do {
-            ( (alloc_link*)(p) )->next_ = (alloc_link*)( p + elsize_ ); p += elsize_;
-      case 7:
-            ( (alloc_link*)(p) )->next_ = (alloc_link*)( p + elsize_ ); p += elsize_;
-      case 6:
-            ( (alloc_link*)(p) )->next_ = (alloc_link*)( p + elsize_ ); p += elsize_;
-      case 5:
-            ( (alloc_link*)(p) )->next_ = (alloc_link*)( p + elsize_ ); p += elsize_;
-      case 4:
-            ( (alloc_link*)(p) )->next_ = (alloc_link*)( p + elsize_ ); p += elsize_;
-      case 3:
-            ( (alloc_link*)(p) )->next_ = (alloc_link*)( p + elsize_ ); p += elsize_;
-      case 2:
-            ( (alloc_link*)(p) )->next_ = (alloc_link*)( p + elsize_ ); p += elsize_;
-      case 1:
-            ( (alloc_link*)(p) )->next_ = (alloc_link*)( p + elsize_ ); p += elsize_;
-            
-         } while ( --nn > 0 );
+      ctl->owner_.store( fb_thread_id(), std::memory_order_relaxed );
+      ctl = ctl->next_;
    }
-   ( (alloc_link*)(p) )->next_ = 0;
+   while ( ctl != ctl_ );
 #endif
+}
 
-   pool_head_ = start;
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline bool
+fb_alloc<T,nof_elements,alignment,hooks>::owned( void ) const
+{
+   return ctl_->owner_.load( std::memory_order_relaxed ) == fb_thread_id();
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> void 
-fb_alloc<T,nof_elements,alignment>::clean( void )
+//
+// blocks freed by other threads go back to the free lists, all of them
+// taken with one exchange. Returns false if there were none
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> bool
+fb_alloc<T,nof_elements,alignment,hooks>::drain_remote( void )
 {
-   char* ptr = chunk_head_;
-   while ( ptr != 0 )
+   if ( ctl_->remote_head_.load( std::memory_order_relaxed ) == 0 )
    {
-      *(char**)(&chunk_head_) = *(char**)(ptr + elsize_*nof_elmts_); // memcpy( &chunk_head_, ptr + elsize_*nof_elmts_, sizeof(char*) );
-      deallocate_chunk( ptr );
-      ptr = chunk_head_;
+      return false;
    }
-   pool_head_  = 0;
-   chunk_head_ = 0;
-}
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline bool
-fb_alloc<T,nof_elements,alignment>::check( const pointer p ) const
-{
-   char* ptr = chunk_head_;
-   char* pob = static_cast<char*>( static_cast<void*>(p) );
-   while ( ptr != 0 )
+   char*  p          = ctl_->remote_head_.exchange( 0, std::memory_order_acquire );
+   size_t nof_frees  = 0;
+   size_t nof_blocks = 0;
+   while ( p != 0 )
    {
-      if ( (pob >= ptr) && (pob <= ptr + (nof_elmts_-1)*elsize_) )
+      remote_link* rl   = static_cast<remote_link*>( static_cast<void*>(p) );
+      char*        next = reinterpret_cast<char*>( rl->next_ & ~uintptr_t(1) );
+      char**       head = &ctl_->pool_head_;
+      size_t       nb   = 1;
+      if ( rl->next_ & 1 )
       {
-         return true;
+         head = &ctl_->run_heads_[rl->run_class_];
+         nb   = size_t(2) << rl->run_class_;
       }
-      *(char**)(&ptr) = *(char**)(ptr + elsize_*nof_elmts_);  // memcpy( &ptr, ptr + elsize_*nof_elmts_, sizeof(char*) );
+
+      poison( p, nb*ctl_->elsize_ );
+      link_block( p, *head );
+      *head = p;
+      --block_header( p )->live_;
+
+      ++nof_frees;
+      nof_blocks += nb;
+      p = next;
    }
-   return false;
+   count_free( nof_frees, nof_blocks );
+   return true;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline char*
-fb_alloc<T,nof_elements,alignment>::allocate_chunk( void ) const
+//
+// list head...tail goes to the remote list with single CAS, lowest bit of the tail link
+// tells if it is the run and is kept
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::push_remote( char* head, char* tail )
 {
-#ifdef CHUNKS_RETURNED_TO_MALLOC
-   return new char [ elsize_*nof_elmts_ + sizeof(char*) ];
-#else
-   if ( global_chunk_head_ == 0 ) // no more preallocated chunks, ask malloc nicely for additional chunk
+   remote_link* last = static_cast<remote_link*>( static_cast<void*>(tail) );
+   uintptr_t    tag  = last->next_ & 1;
+   char*        top  = ctl_->remote_head_.load( std::memory_order_relaxed );
+   do
    {
-      ++nof_allocated_chunks_;
-      char* pp = new char [ elsize_*nof_elmts_ + sizeof(char*) ];
-      memset( pp, 0, elsize_*nof_elmts_ + sizeof(char*) );
-      return pp;
+      last->next_ = reinterpret_cast<uintptr_t>(top) | tag;
    }
-
-   //
-   // chunks are available, return one from the pool
-   //
-   --nof_free_chunks_;
-   assert( nof_free_chunks_ >= 0 );
-   char* res          = global_chunk_head_;
-   global_chunk_head_ = static_cast<char*>(static_cast<void*>( static_cast<alloc_link*>(static_cast<void*>(res))->next_ ));
-
-   return res;
-#endif
+   while ( !ctl_->remote_head_.compare_exchange_weak( top, head,
+                                                     std::memory_order_release,
+                                                     std::memory_order_relaxed ) );
 }
+#endif
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline void
-fb_alloc<T,nof_elements,alignment>::deallocate_chunk( char* p ) const
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> template <typename U, typename... Args> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::construct( U* p, Args&&... args )
 {
-#ifdef CHUNKS_RETURNED_TO_MALLOC
-   delete [] p;
-#else
-   //
-   // instead of returning memory to malloc/OS,
-   // keep global linked list of chunks for future requests
-   //
-
-//    std::cerr << "D: ";
-
-   alloc_link* ptr    = static_cast<alloc_link*>( static_cast<void*>(p) );
-   ptr->next_         = static_cast<alloc_link*>( static_cast<void*>(global_chunk_head_) );
-   global_chunk_head_ = static_cast<char*>( static_cast<void*>(ptr) );
-   ++nof_free_chunks_;
+   ::new( static_cast<void*>(p) ) U( std::forward<Args>(args)... );
+}
 
-//    std::cerr << nof_free_chunks_ << std::endl;   
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> template <typename U> inline void
+fb_alloc<T,nof_elements,alignment,hooks>::destroy( U* p )
+{
+   p->~U();
+}
 
-   assert( nof_free_chunks_ <= nof_allocated_chunks_ );
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline
+typename fb_alloc<T,nof_elements,alignment,hooks>::pointer
+fb_alloc<T,nof_elements,alignment,hooks>::address( reference r ) const
+{
+   return &r;
+}
 
-#endif
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline
+typename fb_alloc<T,nof_elements,alignment,hooks>::const_pointer 
+fb_alloc<T,nof_elements,alignment,hooks>::address( const_reference cr ) const
+{
+   return &cr;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline
-typename fb_alloc<T,nof_elements,alignment>::pointer
-fb_alloc<T,nof_elements,alignment>::allocate( size_type n, const void* hint )
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline
+typename fb_alloc<T,nof_elements,alignment,hooks>::size_type    
+fb_alloc<T,nof_elements,alignment,hooks>::max_size( void ) const noexcept
 {
-   if ( n == 1 )
-   {      
-      if ( pool_head_ == 0 )
-      {
-         grow();
-      }
-      char* res  = pool_head_;
-      pool_head_ = static_cast<char*>(static_cast<void*>( static_cast<alloc_link*>(static_cast<void*>(res))->next_ ));
-      
-      ++*nof_allocs_; 
-      assert( *nof_allocs_ > 0 );
+   return size_type(-1) / sizeof(T);
+}
 
-      return static_cast<pointer>(static_cast<void*>(res));
-   }
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline unsigned int 
+fb_alloc<T,nof_elements,alignment,hooks>::nof_elmts( void ) const
+{
+   return static_cast<unsigned int>( ctl_->blocks_/ctl_->elsize_ );
+}
 
-   return static_cast<pointer>( ::operator new (n*sizeof(T)) );
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline size_t
+fb_alloc<T,nof_elements,alignment,hooks>::elsize( void ) const
+{
+   return ctl_->elsize_;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline void
-fb_alloc<T,nof_elements,alignment>::deallocate( pointer p, size_type n )
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline size_t
+fb_alloc<T,nof_elements,alignment,hooks>::chunksize( void ) const
 {
-   if ( n == 1 )
-   {
-      //
-      // check in p is allocated by us: should walk the chunks
-      //
-      assert( check(p) );
-      
-      alloc_link* ptr = static_cast<alloc_link*>( static_cast<void*>(p) );
-      ptr->next_      = static_cast<alloc_link*>( static_cast<void*>(pool_head_) );
-      pool_head_      = static_cast<char*>( static_cast<void*>(ptr) );
-      --*nof_allocs_;
-      assert( *nof_allocs_ >= 0 );
-   }
-   else
-   {
-      ::operator delete ( p );
-   }
+   return ctl_->span_;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline void    
-fb_alloc<T,nof_elements,alignment>::construct(  pointer p )
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline size_t
+fb_alloc<T,nof_elements,alignment,hooks>::alignmnt( void ) const
 {
-   new(p) T;
+   return alignment_;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline void    
-fb_alloc<T,nof_elements,alignment>::construct(  pointer p, const T& val )
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline int
+fb_alloc<T,nof_elements,alignment,hooks>::refcount( void ) const
 {
-   new(p) T(val);
+   if ( ctl_->root_ == 0 )
+   {
+      return 0;
+   }
+   return ctl_->root_->refcount_;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline void
-fb_alloc<T,nof_elements,alignment>::destroy( pointer p )
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline int
+fb_alloc<T,nof_elements,alignment,hooks>::nof_allocs( void ) const
 {
-   p->~T();
+   return static_cast<int>( ctl_->allocs_.get() - ctl_->frees_.get() );
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline
-typename fb_alloc<T,nof_elements,alignment>::pointer
-fb_alloc<T,nof_elements,alignment>::address( reference r ) const
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> fb_pool_stats
+fb_alloc<T,nof_elements,alignment,hooks>::pool_stats( const fb_pool_control* ctl )
 {
-   return &r;
+   fb_pool_stats res = fb_pool_stats();
+   res.allocs         = ctl->allocs_.get();
+   res.frees          = ctl->frees_.get();
+   res.grows          = ctl->grows_.get();
+   res.live_blocks    = ctl->live_blocks_.get();
+   res.peak_blocks    = ctl->peak_blocks_.get();
+   res.bytes_reserved = ctl->chunks_.get()*ctl->span_;
+   res.bytes_in_use   = res.live_blocks*ctl->elsize_;
+   return res;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline
-typename fb_alloc<T,nof_elements,alignment>::const_pointer 
-fb_alloc<T,nof_elements,alignment>::address( const_reference cr ) const
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline fb_pool_stats
+fb_alloc<T,nof_elements,alignment,hooks>::stats( void ) const
 {
-   return &cr;
+   return pool_stats( ctl_ );
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline
-typename fb_alloc<T,nof_elements,alignment>::size_type    
-fb_alloc<T,nof_elements,alignment>::max_size( void ) const throw()
+//
+// sum over the pools of our type plus counters of GLOBAL list. Pools taken over by
+// another type (see join_family()) are counted there, their chunks are still ours
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> fb_pool_stats
+fb_alloc<T,nof_elements,alignment,hooks>::type_stats( void )
 {
-   return elsize_;
+   fb_pool_stats res = fb_pool_stats();
+   {
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+      std::lock_guard<std::mutex> lock( pools_mutex_ );
+#endif
+      for( const fb_pool_control* ctl = pools_; ctl != 0; ctl = ctl->type_next_ )
+      {
+         fb_pool_stats st = pool_stats( ctl );
+         res.allocs       += st.allocs;
+         res.frees        += st.frees;
+         res.grows        += st.grows;
+         res.live_blocks  += st.live_blocks;
+         res.peak_blocks  += st.peak_blocks;
+         res.bytes_in_use += st.bytes_in_use;
+      }
+   }
+   res.depot_chunks    = depot_chunks_.get();
+   res.provider_chunks = provider_chunks_.get();
+#ifndef CHUNKS_RETURNED_TO_MALLOC
+   res.free_chunks     = static_cast<uint64_t>( nof_free_chunks_ );
+#endif
+   res.bytes_reserved  = (res.provider_chunks - released_chunks_.get())*span_;
+   return res;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline unsigned int 
-fb_alloc<T,nof_elements,alignment>::nof_elmts( void ) const
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks>  void
+fb_alloc<T,nof_elements,alignment,hooks>::dump( std::ostream& os ) const
 {
-   return nof_elmts_;
+   os << "pool: " << stats() << std::endl;
+   os << "type: " << type_stats() << std::endl;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline size_t
-fb_alloc<T,nof_elements,alignment>::elsize( void ) const
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> template <typename F> inline size_t
+fb_alloc<T,nof_elements,alignment,hooks>::for_each_live( F f ) const
 {
-   return elsize_;
+   live_visitor<F> v = { f };
+   return visit_live( ctl_, v );
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline size_t
-fb_alloc<T,nof_elements,alignment>::chunksize( void ) const
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> inline size_t
+fb_alloc<T,nof_elements,alignment,hooks>::report_leaks( std::ostream& os ) const
 {
-   return elsize_*nof_elmts_ + sizeof(char*);
+   return leak_report( ctl_, os );
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline size_t
-fb_alloc<T,nof_elements,alignment>::alignmnt( void ) const
+//
+// calls f( block ) for every block in use. Occupancy is not kept anywhere: segments without
+// live blocks are skipped, bitmap of free blocks of the rest is built from the free lists,
+// the remote list and the part of the newest chunk not carved yet, then it is scanned
+// word by word
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> template <typename F> size_t
+fb_alloc<T,nof_elements,alignment,hooks>::visit_live( const fb_pool_control* ctl, F& f )
 {
-   return alignment_;
+   std::vector<char*> segs;
+   for( char* ptr = ctl->chunk_head_; ptr != 0; ptr = header_of( ptr )->next_ )
+   {
+      for( unsigned int k = 0; k != header_of( ptr )->nof_spans_; ++k )
+      {
+         char* seg = ptr + k*ctl->span_;
+         if ( header_of( seg )->live_ != 0 )
+         {
+            segs.push_back( seg );
+         }
+      }
+   }
+   if ( segs.empty() )
+   {
+      return 0;
+   }
+   std::sort( segs.begin(), segs.end() );
+
+   //
+   // bits after the last block of the segment are taken as free
+   //
+   size_t nof_blocks = ctl->blocks_/ctl->elsize_;
+   size_t nof_words  = (nof_blocks + 63)/64;
+   std::vector<uint64_t> bits( segs.size()*nof_words, 0 );
+   if ( nof_blocks % 64 != 0 )
+   {
+      for( size_t s = 0; s != segs.size(); ++s )
+      {
+         bits[s*nof_words + nof_words - 1] = ~uint64_t(0) << (nof_blocks % 64);
+      }
+   }
+
+   for( char* p = ctl->pool_head_; p != 0; p = decode_link( p ) )
+   {
+      mark_free( ctl, segs, bits.data(), p, 1 );
+   }
+   for( unsigned int rc = 0; rc != fb_log2(CHUNKS_MAX_RUN); ++rc )
+   {
+      for( char* p = ctl->run_heads_[rc]; p != 0; p = decode_link( p ) )
+      {
+         mark_free( ctl, segs, bits.data(), p, size_t(2) << rc );
+      }
+   }
+#ifdef CHUNKS_SHARED_BETWEEN_THREADS
+   for( char* p = ctl->remote_head_.load( std::memory_order_acquire ); p != 0; )
+   {
+      const remote_link* rl = static_cast<const remote_link*>( static_cast<void*>(p) );
+      mark_free( ctl, segs, bits.data(), p, (rl->next_ & 1) ? (size_t(2) << rl->run_class_) : 1 );
+      p = reinterpret_cast<char*>( rl->next_ & ~uintptr_t(1) );
+   }
+#endif
+   if ( ctl->bump_ptr_ != 0 )
+   {
+      char* end = chunk_of( ctl->bump_ptr_, ctl->span_ ) + ctl->first_ + ctl->blocks_;
+      mark_free( ctl, segs, bits.data(), ctl->bump_ptr_, static_cast<size_t>( end - ctl->bump_ptr_ )/ctl->elsize_ );
+   }
+
+   size_t count = 0;
+   for( size_t s = 0; s != segs.size(); ++s )
+   {
+      char* first = segs[s] + ctl->first_;
+      for( size_t w = 0; w != nof_words; ++w )
+      {
+         uint64_t used = ~bits[s*nof_words + w];
+         while ( used != 0 )
+         {
+            f( first + (64*w + fb_ctz64( used ))*ctl->elsize_ );
+            used &= used - 1;
+            ++count;
+         }
+      }
+   }
+   return count;
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline int
-fb_alloc<T,nof_elements,alignment>::refcount( void ) const
+//
+// nof_blocks free blocks from p on, segments without live blocks are not in segs
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> void
+fb_alloc<T,nof_elements,alignment,hooks>::mark_free( const fb_pool_control* ctl, const std::vector<char*>& segs,
+                                                     uint64_t* bits, char* p, size_t nof_blocks )
 {
-   if ( refcount_ )
+   char* seg = chunk_of( p, ctl->span_ );
+   std::vector<char*>::const_iterator it = std::lower_bound( segs.begin(), segs.end(), seg );
+   if ( it == segs.end() || *it != seg )
+   {
+      return;
+   }
+
+   uint64_t* words = bits + static_cast<size_t>( it - segs.begin() )*((ctl->blocks_/ctl->elsize_ + 63)/64);
+   size_t    idx   = static_cast<size_t>( p - seg - ctl->first_ )/ctl->elsize_;
+   for( size_t end = idx + nof_blocks; idx != end; ++idx )
    {
-      return *refcount_;
+      words[idx/64] |= uint64_t(1) << (idx % 64);
    }
-   return 0;  
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment> inline int
-fb_alloc<T,nof_elements,alignment>::nof_allocs( void ) const
+//
+// first leak_printer::max_listed blocks in use are listed. Report is skipped
+// if there is no memory to build it
+//
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> size_t
+fb_alloc<T,nof_elements,alignment,hooks>::leak_report( const fb_pool_control* ctl, std::ostream& os ) noexcept
 {
-   if ( nof_allocs_ )
+   leak_printer lp = leak_printer();
+   try
    {
-      return *nof_allocs_;
+      visit_live( ctl, lp );
    }
-   return 0;
+   catch( const std::bad_alloc& )
+   {
+      return 0;
+   }
+
+   if ( lp.count_ != 0 )
+   {
+      os << "fb_alloc: " << lp.count_ << " blocks of " << ctl->elsize_ << " bytes still in use in pool "
+         << static_cast<const void*>(ctl) << ":";
+      for( size_t k = 0; k != lp.count_ && k != leak_printer::max_listed; ++k )
+      {
+         os << " " << static_cast<const void*>( lp.listed_[k] );
+      }
+      if ( lp.count_ > leak_printer::max_listed )
+      {
+         os << " ...";
+      }
+      os << std::endl;
+   }
+   return lp.count_;
+}
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> template <typename U> inline bool
+fb_alloc<T,nof_elements,alignment,hooks>::same_family( const fb_alloc<U,nof_elements,alignment,hooks>& fba ) const noexcept
+{
+   return ctl_->root_ == fba.ctl_->root_;
+}
+
+template <typename T, typename U, unsigned int nof_elements, size_t alignment, typename hooks> inline bool
+operator==( const fb_alloc<T,nof_elements,alignment,hooks>& a, const fb_alloc<U,nof_elements,alignment,hooks>& b ) noexcept
+{
+   return a.same_family( b );
 }
 
-template <typename T, unsigned int nof_elements, size_t alignment>  void
-fb_alloc<T,nof_elements,alignment>::dump( std::ostream& os ) const
+template <typename T, typename U, unsigned int nof_elements, size_t alignment, typename hooks> inline bool
+operator!=( const fb_alloc<T,nof_elements,alignment,hooks>& a, const fb_alloc<U,nof_elements,alignment,hooks>& b ) noexcept
 {
-   os << "A: " << nof_allocated_chunks_ << " " << nof_free_chunks_ << std::endl;
+   return !a.same_family( b );
 }
 
 #endif // FB_ALLOC_H
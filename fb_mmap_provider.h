@@ -0,0 +1,196 @@
+// -*- C++ -*-
+
+#ifndef FB_MMAP_PROVIDER_H
+#define FB_MMAP_PROVIDER_H
+
+#include "fb_alloc.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <mutex>
+#include <vector>
+
+//
+// Chunk provider which maps large slabs (2MB by default) of anonymous memory
+// and carves them into chunks. Slabs could be backed by transparent huge pages
+// (MADV_HUGEPAGE) or by explicit huge pages (MAP_HUGETLB, falls back to
+// transparent ones if no huge pages are reserved), so big pools take far fewer
+// TLB entries. Pages are faulted in only when blocks are carved from them.
+//
+// Chunks given back are kept on free lists (per chunk size) with their pages
+// dropped by madvise(MADV_DONTNEED). Only pages lying wholly inside the chunk are
+// dropped, chunks smaller than page share it with live neighbours. Chunks not
+// smaller than the slab have their own mapping and are unmapped. Provider should
+// outlive everything allocated from it, chunks cached in GLOBAL lists included,
+// all slabs are unmapped in destructor. Thus it is usually a static object:
+//
+// static fb_mmap_provider hp( fb_mmap_provider::TRANSPARENT_HUGE_PAGES );
+// fb_alloc<node>::set_provider( &hp );
+//
+class fb_mmap_provider : public fb_chunk_provider
+{
+   public:
+
+      enum huge_pages
+      {
+         NO_HUGE_PAGES,
+         TRANSPARENT_HUGE_PAGES,
+         EXPLICIT_HUGE_PAGES
+      };
+
+      explicit fb_mmap_provider( huge_pages hp = TRANSPARENT_HUGE_PAGES, size_t slab_size = 2*1024*1024 ):
+         huge_pages_( hp ),
+         slab_size_( slab_size ),
+         cur_( 0 ),
+         end_( 0 )
+      {
+         assert( slab_size_ > 0 && (slab_size_ & (slab_size_ - 1)) == 0 );
+         for( int k = 0; k != nof_spans; ++k )
+         {
+            free_[k] = 0;
+         }
+      }
+
+      ~fb_mmap_provider( void )
+      {
+         for( size_t k = 0; k != maps_.size(); ++k )
+         {
+            munmap( maps_[k].first, maps_[k].second );
+         }
+      }
+
+      virtual char* allocate( size_t span )
+      {
+         std::lock_guard<std::mutex> lock( mutex_ );
+
+         if ( span >= slab_size_ )
+         {
+            return map( span );
+         }
+
+         unsigned int k = fb_log2( span );
+         if ( free_[k] != 0 )
+         {
+            char* res = free_[k];
+            free_[k]  = *(char**)(res);
+            return res;
+         }
+
+         //
+         // slab is aligned to its size, so carving chunks of the same span
+         // keeps them aligned, mixed spans could leave the gap
+         //
+         char* p = reinterpret_cast<char*>( (reinterpret_cast<uintptr_t>(cur_) + span - 1) & ~static_cast<uintptr_t>(span - 1) );
+         if ( (cur_ == 0) || (p + span > end_) )
+         {
+            p    = map( slab_size_ );
+            end_ = p + slab_size_;
+         }
+         cur_ = p + span;
+         return p;
+      }
+
+      virtual void deallocate( char* p, size_t span )
+      {
+         std::lock_guard<std::mutex> lock( mutex_ );
+
+         if ( span >= slab_size_ )
+         {
+            for( size_t k = 0; k != maps_.size(); ++k )
+            {
+               if ( maps_[k].first == p )
+               {
+                  maps_[k] = maps_.back();
+                  maps_.pop_back();
+                  break;
+               }
+            }
+            munmap( p, span );
+            return;
+         }
+
+         if ( huge_pages_ != EXPLICIT_HUGE_PAGES ) // hugetlb pages are kept
+         {
+            static const uintptr_t page = static_cast<uintptr_t>( sysconf(_SC_PAGESIZE) );
+
+            char* from = reinterpret_cast<char*>( (reinterpret_cast<uintptr_t>(p) + page - 1) & ~(page - 1) );
+            char* to   = reinterpret_cast<char*>( reinterpret_cast<uintptr_t>(p + span) & ~(page - 1) );
+            if ( from < to )
+            {
+               madvise( from, to - from, MADV_DONTNEED );
+            }
+         }
+         unsigned int k = fb_log2( span );
+         *(char**)(p) = free_[k];
+         free_[k]     = p;
+      }
+
+   private:
+
+      fb_mmap_provider( const fb_mmap_provider& );
+      fb_mmap_provider& operator=( const fb_mmap_provider& );
+
+      //
+      // size bytes aligned to size: map more, unmap the excess at both ends
+      //
+      char* map( size_t size )
+      {
+         char* p = 0;
+#ifdef MAP_HUGETLB
+         if ( huge_pages_ == EXPLICIT_HUGE_PAGES )
+         {
+            p = map_aligned( size, MAP_HUGETLB );
+         }
+#endif
+         if ( p == 0 )
+         {
+            p = map_aligned( size, 0 );
+#ifdef MADV_HUGEPAGE
+            if ( (p != 0) && (huge_pages_ != NO_HUGE_PAGES) )
+            {
+               madvise( p, size, MADV_HUGEPAGE );
+            }
+#endif
+         }
+         if ( p == 0 )
+         {
+            throw std::bad_alloc();
+         }
+         maps_.push_back( std::make_pair( p, size ) );
+         return p;
+      }
+
+      static char* map_aligned( size_t size, int flags )
+      {
+         void* m = mmap( 0, 2*size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0 );
+         if ( m == MAP_FAILED )
+         {
+            return 0;
+         }
+         char* base = static_cast<char*>( m );
+         char* p    = reinterpret_cast<char*>( (reinterpret_cast<uintptr_t>(base) + size - 1) & ~static_cast<uintptr_t>(size - 1) );
+         if ( p != base )
+         {
+            munmap( base, p - base );
+         }
+         if ( base + 2*size != p + size )
+         {
+            munmap( p + size, base + 2*size - (p + size) );
+         }
+         return p;
+      }
+
+      static const int nof_spans = 8*sizeof(size_t);
+
+      huge_pages  huge_pages_;
+      size_t      slab_size_;
+
+      std::mutex  mutex_;
+      char*       cur_;              // first unused byte of the current slab
+      char*       end_;              // end of the current slab
+      char*       free_[nof_spans];  // chunks given back, by log2 of the chunk size
+
+      std::vector< std::pair<char*,size_t> > maps_; // all mappings, unmapped in destructor
+};
+
+#endif // FB_MMAP_PROVIDER_H
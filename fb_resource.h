@@ -0,0 +1,141 @@
+// -*- C++ -*-
+
+#ifndef FB_RESOURCE_H
+#define FB_RESOURCE_H
+
+#include "fb_size_class.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+#include <tuple>
+#include <utility>
+
+//
+// std::pmr::memory_resource over fixed-block pools (C++17).
+//
+// Every size class up to FB_MAX_CLASS_SIZE gets its own fb_alloc pool, do_allocate()
+// rounds the request up to the class and takes one block from the pool of that class.
+// Larger or over-aligned requests go to the upstream resource. Pools of the same class
+// in different resources share GLOBAL chunk list, the same way fb_class_alloc does.
+//
+// Like std::pmr::unsynchronized_pool_resource it is not thread safe, memory should be
+// given back to the resource it was taken from, and it should outlive everything
+// allocated from it:
+//
+// fb_memory_resource res;
+// std::pmr::map<int, std::pmr::string> m( &res );
+//
+class fb_memory_resource : public std::pmr::memory_resource
+{
+   public:
+
+      //
+      // element count of the chunk of each pool
+      //
+      static constexpr unsigned int nof_elements = 100;
+
+      //
+      // classes are multiple of 16 bytes (but the first one) and
+      // chunks are aligned to their size, so are the blocks
+      //
+      static constexpr size_t max_alignment = 16;
+
+      static constexpr size_t nof_classes = fb_class_index( FB_MAX_CLASS_SIZE ) + 1;
+
+      static_assert( fb_class_at( nof_classes - 1 ) == FB_MAX_CLASS_SIZE,
+                     "FB_MAX_CLASS_SIZE should be size class itself" );
+
+      explicit fb_memory_resource( std::pmr::memory_resource* upstream = std::pmr::get_default_resource() ) noexcept:
+         upstream_( upstream )
+      {
+      }
+
+      fb_memory_resource( const fb_memory_resource& ) = delete;
+      fb_memory_resource& operator=( const fb_memory_resource& ) = delete;
+
+      //
+      // give all chunks of all pools back, memory taken from upstream is not tracked
+      // and stays with its owners. NB: no destructors are called
+      //
+      void release( void )
+      {
+         std::apply( []( auto&... pool ) { ( pool.release(), ... ); }, pools_ );
+      }
+
+      std::pmr::memory_resource* upstream_resource( void ) const noexcept
+      {
+         return upstream_;
+      }
+
+   protected:
+
+      void* do_allocate( size_t bytes, size_t alignment ) override
+      {
+         if ( bytes > FB_MAX_CLASS_SIZE || alignment > max_alignment )
+         {
+            return upstream_->allocate( bytes, alignment );
+         }
+         void* p = pool_set<>::allocators[ class_of( bytes, alignment ) ]( pools_ );
+         assert( reinterpret_cast<uintptr_t>( p ) % alignment == 0 );
+         return p;
+      }
+
+      void do_deallocate( void* p, size_t bytes, size_t alignment ) override
+      {
+         if ( bytes > FB_MAX_CLASS_SIZE || alignment > max_alignment )
+         {
+            upstream_->deallocate( p, bytes, alignment );
+            return;
+         }
+         pool_set<>::deallocators[ class_of( bytes, alignment ) ]( pools_, p );
+      }
+
+      bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override
+      {
+         return this == &other;
+      }
+
+   private:
+
+      //
+      // class of the request, zero bytes still take the block of alignment bytes
+      // (class 0 is 8 bytes only). The same on both paths, so the block goes back
+      // to the pool it was taken from
+      //
+      static size_t class_of( size_t bytes, size_t alignment )
+      {
+         return fb_class_index( fb_round_up( std::max( bytes, alignment ), alignment ) );
+      }
+
+      template <size_t k> using pool = fb_alloc< fb_block< fb_class_at(k), 8 >, nof_elements, 8 >;
+
+      //
+      // tuple of pools, one per class, and tables of functions which
+      // take block from the pool / put it back, indexed by class
+      //
+      template <typename S = std::make_index_sequence<nof_classes> > struct pool_set;
+
+      template <size_t... k> struct pool_set< std::index_sequence<k...> >
+      {
+         typedef std::tuple< pool<k>... > type;
+
+         template <size_t j> static void* allocate_from( type& pools )
+         {
+            return std::get<j>( pools ).allocate( 1 );
+         }
+
+         template <size_t j> static void deallocate_to( type& pools, void* p )
+         {
+            std::get<j>( pools ).deallocate( static_cast<typename pool<j>::pointer>( p ), 1 );
+         }
+
+         static constexpr void* (*allocators[])( type& )          = { &allocate_from<k>... };
+         static constexpr void  (*deallocators[])( type&, void* ) = { &deallocate_to<k>... };
+      };
+
+      std::pmr::memory_resource* upstream_; // source of large and over-aligned blocks
+      pool_set<>::type           pools_;
+};
+
+#endif // FB_RESOURCE_H
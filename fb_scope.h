@@ -0,0 +1,154 @@
+// -*- C++ -*-
+
+#ifndef FB_SCOPE_H
+#define FB_SCOPE_H
+
+#include "fb_alloc.h"
+
+#include <forward_list>
+#include <list>
+#include <map>
+#include <set>
+
+//
+// container which takes every piece of its memory with allocate(1), so all of it lives
+// in the chunks of the pool. Arrays (vector, deque, unordered_* buckets) of more than
+// CHUNKS_MAX_RUN elements come from operator new and are freed only by the container.
+// Could be specialized for other node based containers
+//
+template <typename C> struct fb_scope_node_container : std::false_type {};
+
+template <typename T, typename A> struct fb_scope_node_container< std::list<T, A> > : std::true_type {};
+template <typename T, typename A> struct fb_scope_node_container< std::forward_list<T, A> > : std::true_type {};
+template <typename K, typename P, typename A> struct fb_scope_node_container< std::set<K, P, A> > : std::true_type {};
+template <typename K, typename P, typename A> struct fb_scope_node_container< std::multiset<K, P, A> > : std::true_type {};
+template <typename K, typename V, typename P, typename A> struct fb_scope_node_container< std::map<K, V, P, A> > : std::true_type {};
+template <typename K, typename V, typename P, typename A> struct fb_scope_node_container< std::multimap<K, V, P, A> > : std::true_type {};
+
+//
+// Request scope over the family of fb_alloc pools. Containers made by the scope take
+// their memory from the family of its allocator, container objects themselves live there
+// as well. When the scope ends, node containers (see fb_scope_node_container) of trivially
+// destructible elements are dropped without walking their nodes. The others are destroyed
+// first, which is O(n) for them. Then all chunks of the family go back to GLOBAL list
+// at once, see fb_alloc::reset():
+//
+// {
+//    fb_scope< fb_alloc<int> > scope;
+//    auto& m = scope.make< std::map<int, int, std::less<int>, fb_alloc<std::pair<const int, int> > > >();
+//    ...
+// } // no node of the map is visited
+//
+// Container should take its allocator as the last constructor argument and should not be
+// destroyed by hand. Scope could be reused after reset(), it is not copyable
+//
+template <typename Alloc> class fb_scope
+{
+   public:
+
+      fb_scope( void ) noexcept:
+         objects_( 0 ),
+         nof_refs_( 0 )
+      {
+      }
+
+      //
+      // scope over the family of a
+      //
+      explicit fb_scope( const Alloc& a ) noexcept:
+         alloc_( a ),
+         objects_( 0 ),
+         nof_refs_( 0 )
+      {
+      }
+
+      ~fb_scope( void )
+      {
+         reset();
+      }
+
+      fb_scope( const fb_scope& ) = delete;
+      fb_scope& operator=( const fb_scope& ) = delete;
+
+      //
+      // container C constructed from args followed by the allocator of the scope
+      //
+      template <typename C, typename... Args> C& make( Args&&... args );
+
+      //
+      // destroy containers which could not be dropped, drop everything else
+      //
+      void reset( void );
+
+      const Alloc& allocator( void ) const
+      {
+         return alloc_;
+      }
+
+   private:
+
+      //
+      // container to be destroyed when the scope ends
+      //
+      struct object
+      {
+         object* next_;
+         void*   ptr_;
+         void (* destroy_)( void* ptr );
+      };
+
+      template <typename C> static void destroy( void* ptr )
+      {
+         static_cast<C*>( ptr )->~C();
+      }
+
+      Alloc   alloc_;
+      object* objects_;  // the latest first
+      int     nof_refs_; // references to the family held by allocators of dropped containers
+};
+
+//
+// record is taken before the container is constructed, so nothing could fail after it.
+// Memory of the container which failed to construct is dropped with the rest. Allocators
+// kept by the container which is never destroyed are counted from the family refcount
+//
+template <typename Alloc> template <typename C, typename... Args> C&
+fb_scope<Alloc>::make( Args&&... args )
+{
+   typename Alloc::template rebind<C>::other      cal( alloc_ );
+   typename Alloc::template rebind<object>::other oal( alloc_ );
+
+   const bool dropped = fb_scope_node_container<C>::value &&
+                        std::is_trivially_destructible<typename C::value_type>::value;
+   object*    obj     = dropped ? 0 : oal.allocate( 1 );
+   C*         res     = cal.allocate( 1 );
+   const int  refs    = alloc_.refcount();
+   ::new( static_cast<void*>(res) ) C( std::forward<Args>(args)..., typename C::allocator_type( alloc_ ) );
+
+   if ( obj != 0 )
+   {
+      obj->next_    = objects_;
+      obj->ptr_     = res;
+      obj->destroy_ = &destroy<C>;
+      objects_      = obj;
+   }
+   else
+   {
+      nof_refs_ += alloc_.refcount() - refs;
+   }
+   return *res;
+}
+
+template <typename Alloc> void
+fb_scope<Alloc>::reset( void )
+{
+   for( object* obj = objects_; obj != 0; obj = obj->next_ )
+   {
+      obj->destroy_( obj->ptr_ );
+   }
+   objects_ = 0;
+   alloc_.reset( nof_refs_ );
+   nof_refs_ = 0;
+}
+
+#endif // FB_SCOPE_H
@@ -0,0 +1,201 @@
+// -*- C++ -*-
+
+#ifndef FB_SIZE_CLASS_H
+#define FB_SIZE_CLASS_H
+
+#include "fb_alloc.h"
+
+//
+// Size-class front-end for fb_alloc.
+//
+// Element size is rounded the same way fb_alloc does it and then rounded up again
+// to the nearest size class. Every type falling into the same class is served by
+// fb_alloc of the same block type, thus all of them share one GLOBAL chunk list
+// instead of keeping separate list per type.
+//
+// Classes: 8, then 16 bytes steps up to 128, then four classes per doubling
+// (160, 192, 224, 256, 320, ...) up to FB_MAX_CLASS_SIZE. Larger sizes are not
+// rounded to a class and get pool of their own.
+//
+#ifndef FB_MAX_CLASS_SIZE
+#define FB_MAX_CLASS_SIZE 1024
+#endif
+
+//
+// largest power of two which is not greater than n
+//
+inline constexpr size_t fb_floor_pow2( size_t n )
+{
+   return (n < 2) ? n : 2*fb_floor_pow2( n/2 );
+}
+
+inline constexpr size_t fb_class_size( size_t n )
+{
+   return (n <= 8)                 ? 8                                  :
+          (n <= 128)               ? fb_round_up( n, 16 )               :
+          (n <= FB_MAX_CLASS_SIZE) ? fb_round_up( n, fb_floor_pow2(n - 1)/4 ) :
+                                     n;
+}
+
+//
+// classes are numbered from 0 (8 bytes), fb_class_at() is inverse of fb_class_index()
+// for n <= FB_MAX_CLASS_SIZE
+//
+inline constexpr size_t fb_class_index( size_t n )
+{
+   return (n <= 8)   ? 0              :
+          (n <= 128) ? (n + 15)/16    :
+                       9 + 4*(fb_log2( fb_floor_pow2(fb_class_size(n) - 1) ) - 7) +
+                       (fb_class_size(n) - fb_floor_pow2(fb_class_size(n) - 1))/(fb_floor_pow2(fb_class_size(n) - 1)/4) - 1;
+}
+
+inline constexpr size_t fb_class_at( size_t index )
+{
+   return (index == 0) ? 8          :
+          (index <= 8) ? 16*index   :
+                         (size_t(128) << ((index - 9)/4)) + (size_t(32) << ((index - 9)/4))*((index - 9)%4 + 1);
+}
+
+//
+// storage block of size class, sizeof(fb_block<size,alignment>) == size
+//
+template <size_t size, size_t alignment> struct fb_block
+{
+   alignas(alignment) char data_[size];
+};
+
+template <typename T, unsigned int nof_elements=100, size_t alignment=8, typename hooks=fb_no_hooks> class fb_class_alloc
+{
+   public:
+
+      //
+      // FB_ALIGN_NATURAL: types of the class with different alignment get different blocks
+      //
+      static const size_t block_alignment = (alignment != FB_ALIGN_NATURAL) ? alignment : alignof(T);
+      static const size_t class_size      = fb_round_up( fb_class_size( fb_round_up( sizeof(T), block_alignment ) ), block_alignment );
+
+      typedef fb_block<class_size, block_alignment>           block_type;
+      typedef fb_alloc<block_type, nof_elements, alignment, hooks> pool_type;
+
+      typedef size_t    size_type;
+      typedef ptrdiff_t difference_type;
+
+      typedef T         value_type;
+      typedef T*        pointer;
+      typedef const T*  const_pointer;
+
+      typedef T&        reference;
+      typedef const T&  const_reference;
+
+      template <typename U> struct rebind
+      {
+         typedef fb_class_alloc<U, nof_elements, alignment, hooks> other;
+      };
+
+      typedef typename pool_type::propagate_on_container_copy_assignment propagate_on_container_copy_assignment;
+      typedef typename pool_type::propagate_on_container_move_assignment propagate_on_container_move_assignment;
+      typedef typename pool_type::propagate_on_container_swap            propagate_on_container_swap;
+      typedef typename pool_type::is_always_equal                        is_always_equal;
+
+      //
+      // ctors and dtors
+      //
+      fb_class_alloc( void ) noexcept {}
+
+      //
+      // chunks of the pool come from upstream, see fb_alloc( fb_chunk_provider& )
+      //
+      explicit fb_class_alloc( fb_chunk_provider& upstream ) noexcept:
+         pool_( upstream )
+      {
+      }
+
+      //
+      // rebind to the type of the same class shares the pool
+      //
+      template <typename U> fb_class_alloc( const fb_class_alloc<U,nof_elements,alignment,hooks>& fca ) noexcept:
+         pool_( fca.pool() )
+      {
+      }
+
+      //
+      // always inlined, so hooks see the call site of the caller, see FB_CALL_SITE()
+      //
+      FB_ALWAYS_INLINE pointer allocate( size_t n, const void* hint = 0 )
+      {
+         return static_cast<pointer>( static_cast<void*>( pool_.allocate( nof_blocks(n), hint ) ) );
+      }
+
+      FB_ALWAYS_INLINE void deallocate( pointer p, size_t n )
+      {
+         pool_.deallocate( static_cast<block_type*>( static_cast<void*>(p) ), nof_blocks(n) );
+      }
+
+      template <typename U, typename... Args> void construct( U* p, Args&&... args )
+      {
+         ::new( static_cast<void*>(p) ) U( std::forward<Args>(args)... );
+      }
+
+      template <typename U> void destroy( U* p )
+      {
+         p->~U();
+      }
+
+      //
+      // observers
+      //
+      size_type max_size( void ) const noexcept
+      {
+         return size_type(-1) / sizeof(T);
+      }
+
+      const pool_type& pool( void ) const
+      {
+         return pool_;
+      }
+
+      //
+      // counters of our pool and of all pools of the class
+      //
+      fb_pool_stats stats( void ) const
+      {
+         return pool_.stats();
+      }
+
+      static fb_pool_stats class_stats( void )
+      {
+         return pool_type::type_stats();
+      }
+
+   private:
+
+      //
+      // number of class blocks which hold n elements
+      //
+      static size_t nof_blocks( size_t n )
+      {
+         return ( n*sizeof(T) + class_size - 1 )/class_size;
+      }
+
+      pool_type pool_;
+};
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> const size_t
+fb_class_alloc<T,nof_elements,alignment,hooks>::block_alignment;
+
+template <typename T, unsigned int nof_elements, size_t alignment, typename hooks> const size_t
+fb_class_alloc<T,nof_elements,alignment,hooks>::class_size;
+
+template <typename T, typename U, unsigned int nof_elements, size_t alignment, typename hooks> inline bool
+operator==( const fb_class_alloc<T,nof_elements,alignment,hooks>& a, const fb_class_alloc<U,nof_elements,alignment,hooks>& b ) noexcept
+{
+   return a.pool() == b.pool();
+}
+
+template <typename T, typename U, unsigned int nof_elements, size_t alignment, typename hooks> inline bool
+operator!=( const fb_class_alloc<T,nof_elements,alignment,hooks>& a, const fb_class_alloc<U,nof_elements,alignment,hooks>& b ) noexcept
+{
+   return !(a == b);
+}
+
+#endif // FB_SIZE_CLASS_H
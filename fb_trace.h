@@ -0,0 +1,251 @@
+// -*- C++ -*-
+
+#ifndef FB_TRACE_H
+#define FB_TRACE_H
+
+#include "fb_alloc.h"
+
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <typeinfo>
+
+//
+// Tracing instrumentation policy for fb_alloc. Every hook call is recorded into
+// process wide lock-free ring buffer together with timestamp, element type,
+// call site and size, the oldest records are overwritten:
+//
+// std::list<node, fb_alloc<node, 100, 8, fb_trace_hooks> > l;
+// ...
+// fb_trace_ring::instance().dump( std::cerr );
+//
+// Records of all types go to the same ring, so grow() storms could be traced
+// back to the container type by the type of the grow records and to the code
+// by the call sites of the allocations just before them. The site is the code which
+// called fb_alloc::allocate(), inlined or not, see FB_CALL_SITE().
+//
+// Running service could stream the trace to a file, dumping only records
+// added since the previous dump, and replay it offline with bench/fb_replay:
+//
+// uint64_t pos = 0;
+// ...
+// pos = fb_trace_ring::instance().dump( trace_file, pos ); // periodically
+//
+#ifndef FB_TRACE_CAPACITY
+#define FB_TRACE_CAPACITY 65536
+#endif
+
+enum fb_trace_event
+{
+   FB_TRACE_ALLOCATE,
+   FB_TRACE_DEALLOCATE,
+   FB_TRACE_GROW,
+   FB_TRACE_ALLOCATE_CHUNK,
+   FB_TRACE_DEALLOCATE_CHUNK
+};
+
+struct fb_trace_record
+{
+   uint64_t              time;    // steady clock, ns
+   const std::type_info* type;    // element type of the allocator
+   const void*           pool;    // control block of the pool, 0 for chunk events
+   const void*           ptr;     // block or chunk
+   const void*           site;    // return address of the allocator call, 0 for grow and chunk events
+   const void*           thread;  // fb_thread_id() of the calling thread
+   size_t                size;    // number of elements, chunk size for grow and chunk events
+   uint32_t              elsize;  // sizeof of the element type
+   uint16_t              elalign; // alignof of the element type
+   uint16_t              event;   // fb_trace_event
+};
+
+//
+// Multi-producer ring of records. Writer claims the slot with one fetch_add and
+// publishes the record through per slot sequence number (seqlock), so no record is ever
+// read half-written. Readers never block writers, records overwritten while being
+// copied are skipped
+//
+class fb_trace_ring
+{
+   public:
+
+      static const size_t capacity = FB_TRACE_CAPACITY;
+
+      static_assert( capacity > 0 && (capacity & (capacity - 1)) == 0,
+                     "FB_TRACE_CAPACITY should be power of two" );
+
+      static fb_trace_ring& instance( void )
+      {
+         static fb_trace_ring ring;
+         return ring;
+      }
+
+      void record( const fb_trace_record& rec )
+      {
+         uint64_t n = next_.fetch_add( 1, std::memory_order_relaxed );
+         slot&    s = slots_[ n & (capacity - 1) ];
+
+         uint64_t w[nof_words] = {};
+         memcpy( w, &rec, sizeof(rec) );
+
+         //
+         // words are released, so reader who sees any of them sees odd sequence number as well
+         //
+         s.seq_.store( 2*n + 1, std::memory_order_relaxed ); // odd while being written
+         for( size_t k = 0; k != nof_words; ++k )
+         {
+            s.words_[k].store( w[k], std::memory_order_release );
+         }
+
+         //
+         // writer which wrapped around the ring meanwhile owns the slot now,
+         // it stays odd until that writer is done
+         //
+         uint64_t seq = 2*n + 1;
+         s.seq_.compare_exchange_strong( seq, 2*n + 2, std::memory_order_release, std::memory_order_relaxed );
+      }
+
+      //
+      // number of records written so far, overwritten ones included
+      //
+      uint64_t nof_records( void ) const
+      {
+         return next_.load( std::memory_order_acquire );
+      }
+
+      //
+      // copy up to max records still in the ring, oldest first, returns number of records copied
+      //
+      size_t snapshot( fb_trace_record* out, size_t max ) const
+      {
+         uint64_t end   = nof_records();
+         uint64_t begin = (end > capacity) ? end - capacity : 0;
+         if ( end - begin > max )
+         {
+            begin = end - max;
+         }
+
+         size_t res = 0;
+         for( uint64_t n = begin; n != end; ++n )
+         {
+            if ( read( n, out[res] ) )
+            {
+               ++res;
+            }
+         }
+         return res;
+      }
+
+      //
+      // one line per record:
+      //    time event type size ptr pool site elsize elalign thread
+      //
+      void dump( std::ostream& os ) const
+      {
+         dump( os, 0 );
+      }
+
+      //
+      // records from number from on, those already overwritten are lost.
+      // Returns number of the next record, the next dump starts there
+      //
+      uint64_t dump( std::ostream& os, uint64_t from ) const
+      {
+         static const char* const names[] = { "allocate", "deallocate", "grow", "allocate_chunk", "deallocate_chunk" };
+
+         uint64_t end   = nof_records();
+         uint64_t begin = (end > capacity) ? end - capacity : 0;
+         for( uint64_t n = std::max( begin, from ); n < end; ++n )
+         {
+            fb_trace_record rec;
+            if ( read( n, rec ) )
+            {
+               os << rec.time << " " << names[rec.event] << " " << rec.type->name() << " " << rec.size
+                  << " " << rec.ptr << " " << rec.pool << " " << rec.site
+                  << " " << rec.elsize << " " << rec.elalign << " " << rec.thread << "\n";
+            }
+         }
+         os.flush();
+         return end;
+      }
+
+   private:
+
+      static const size_t nof_words = (sizeof(fb_trace_record) + sizeof(uint64_t) - 1)/sizeof(uint64_t);
+
+      struct slot
+      {
+         std::atomic<uint64_t> seq_;              // 2*(n + 1) once record n is written
+         std::atomic<uint64_t> words_[nof_words];
+      };
+
+      fb_trace_ring( void ) : next_(0) {}
+
+      fb_trace_ring( const fb_trace_ring& );
+      fb_trace_ring& operator=( const fb_trace_ring& );
+
+      //
+      // record n, if it is still in the ring and not being written
+      //
+      bool read( uint64_t n, fb_trace_record& rec ) const
+      {
+         const slot& s = slots_[ n & (capacity - 1) ];
+
+         uint64_t w[nof_words];
+         uint64_t seq = s.seq_.load( std::memory_order_acquire );
+         for( size_t k = 0; k != nof_words; ++k )
+         {
+            w[k] = s.words_[k].load( std::memory_order_acquire );
+         }
+         if ( seq != 2*n + 2 || s.seq_.load( std::memory_order_relaxed ) != seq )
+         {
+            return false;
+         }
+         memcpy( &rec, w, sizeof(rec) );
+         return true;
+      }
+
+      std::atomic<uint64_t> next_;              // number of the next record
+      slot                  slots_[capacity];
+};
+
+struct fb_trace_hooks
+{
+   template <typename U> static void on_allocate( const void* pool, const void* p, size_t n, const void* site )
+   {
+      trace<U>( FB_TRACE_ALLOCATE, pool, p, n, site );
+   }
+
+   template <typename U> static void on_deallocate( const void* pool, const void* p, size_t n, const void* site )
+   {
+      trace<U>( FB_TRACE_DEALLOCATE, pool, p, n, site );
+   }
+
+   template <typename U> static void on_grow( const void* pool, const void* chunk, size_t span )
+   {
+      trace<U>( FB_TRACE_GROW, pool, chunk, span, 0 );
+   }
+
+   template <typename U> static void on_allocate_chunk( const void* chunk, size_t span )
+   {
+      trace<U>( FB_TRACE_ALLOCATE_CHUNK, 0, chunk, span, 0 );
+   }
+
+   template <typename U> static void on_deallocate_chunk( const void* chunk, size_t span )
+   {
+      trace<U>( FB_TRACE_DEALLOCATE_CHUNK, 0, chunk, span, 0 );
+   }
+
+   template <typename U> static void trace( fb_trace_event ev, const void* pool, const void* p, size_t size, const void* site )
+   {
+      uint64_t now = static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                               std::chrono::steady_clock::now().time_since_epoch() ).count() );
+
+      fb_trace_record rec = { now, &typeid(U), pool, p, site, fb_thread_id(), size,
+                              static_cast<uint32_t>( sizeof(U) ), static_cast<uint16_t>( alignof(U) ),
+                              static_cast<uint16_t>( ev ) };
+      fb_trace_ring::instance().record( rec );
+   }
+};
+
+#endif // FB_TRACE_H
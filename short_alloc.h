@@ -1,28 +1,181 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <cassert>
+#include <new>
+#include <type_traits>
 
-template <std::size_t N>
+// upstream of the chained arena, blocks come from ::operator new
+struct arena_heap_upstream
+{
+    static arena_heap_upstream& instance() noexcept
+    {
+        static arena_heap_upstream up;
+        return up;
+    }
+
+    char* allocate(std::size_t n)
+    {
+        return static_cast<char*>(::operator new(n));
+    }
+
+    void deallocate(char* p, std::size_t) noexcept
+    {
+        ::operator delete(p);
+    }
+};
+
+// state of the chained arena, nothing for the plain one
+template <class Upstream>
+struct arena_chain
+{
+    Upstream* up_;
+    char* blocks_;      // blocks taken from upstream, the latest first
+    char* end_;         // end of the buffer or of the block ptr_ points into
+    std::size_t first_; // size of the first block
+    std::size_t next_;  // size of the next block
+    std::size_t used_;  // bytes carved from the buffer and the blocks left behind
+};
+
+template <>
+struct arena_chain<void>
+{
+};
+
+// nof_classes > 0: sizes are rounded up to alignment, blocks up to nof_classes*alignment
+// bytes freed out of LIFO order are kept on free lists, one per size, and reused
+//
+// Upstream == void: requests which do not fit into the buffer go to ::operator new one by one.
+// Otherwise arena is chained: when the buffer is full, blocks of power of two bytes, each twice
+// as large as the previous one, are taken from upstream and carved the same way, so spilled
+// requests keep bump pointer speed and are never freed one by one. Destructor and reset() give
+// all blocks back. Upstream (arena_heap_upstream, fb_depot_upstream of fb_alloc.h) provides
+//    char* allocate(std::size_t n) - block aligned at least to 16, throws if there is no memory
+//    void  deallocate(char* p, std::size_t n)
+template <std::size_t N, std::size_t nof_classes = 0, class Upstream = void>
 class arena
+    : private arena_chain<Upstream>
 {
     static const std::size_t alignment = 16;
+    static const std::size_t max_recycled = nof_classes*alignment;
+
+    typedef std::integral_constant<bool, !std::is_void<Upstream>::value> chained;
+    typedef typename std::conditional<chained::value, Upstream, arena_heap_upstream>::type upstream_type;
+
+    // upstream block starts with the link to the previous one
+    struct block
+    {
+        char* next_;
+        std::size_t size_;
+    };
+    static const std::size_t header = (sizeof(block) + alignment - 1) & ~(alignment - 1);
 
     alignas(alignment) char buf_[N];
     char* ptr_;
+    char* free_[nof_classes ? nof_classes : 1];
 
     bool pointer_in_buffer(char* p) noexcept
     {
         return buf_ <= p && p <= buf_ + N;
     }
 
+    bool valid() noexcept
+    {
+        return chained::value ? ptr_ != nullptr : pointer_in_buffer(ptr_);
+    }
+
+    char* limit(std::false_type) noexcept
+    {
+        return buf_ + N;
+    }
+
+    char* limit(std::true_type) noexcept
+    {
+        return this->end_;
+    }
+
+    const char* begin(std::true_type) const noexcept
+    {
+        return this->blocks_ ? this->blocks_ + header : buf_;
+    }
+
+    std::size_t used(std::false_type) const noexcept
+    {
+        return static_cast<std::size_t>(ptr_ - buf_);
+    }
+
+    std::size_t used(std::true_type) const noexcept
+    {
+        return this->used_ + static_cast<std::size_t>(ptr_ - begin(chained()));
+    }
+
+    char* spill(std::size_t n, std::false_type)
+    {
+        return static_cast<char*>(::operator new(n));
+    }
+
+    char* spill(std::size_t n, std::true_type)
+    {
+        grow(n);
+        char* r = ptr_;
+        ptr_ += n;
+        return r;
+    }
+
+    bool try_grow(std::size_t, std::false_type) noexcept
+    {
+        return false;
+    }
+
+    bool try_grow(std::size_t n, std::true_type) noexcept
+    {
+        try
+        {
+            grow(n);
+        }
+        catch (...)
+        {
+            return false;
+        }
+        return true;
+    }
+
+    void init(upstream_type& up, std::size_t first_block) noexcept;
+    void grow(std::size_t n);
+    void release(std::false_type) noexcept {}
+    void release(std::true_type) noexcept;
+
+    static std::size_t round_up(std::size_t n) noexcept
+    {
+        return nof_classes ? (n + (alignment-1)) & ~(alignment-1) : n;
+    }
+
+    void clear_free_lists() noexcept
+    {
+        for (std::size_t k = 0; k != nof_classes; ++k)
+            free_[k] = nullptr;
+    }
+
 public:
+    // chained arena takes blocks from Upstream::instance()
     arena() noexcept : ptr_(buf_)
     {
+        clear_free_lists();
+        init(chained());
+    }
+
+    // chained arena only, first_block == 0: twice the buffer
+    explicit arena(upstream_type& up, std::size_t first_block = 0) noexcept : ptr_(buf_)
+    {
+        static_assert(chained::value, "upstream is given to the chained arena only");
+        clear_free_lists();
+        init(up, first_block);
     }
 
     ~arena()
     {
+        release(chained());
         ptr_ = nullptr;
     }
 
@@ -32,67 +185,165 @@ public:
     char* allocate(std::size_t n);
     void deallocate(char* p, std::size_t n) noexcept;
 
+    // n bytes aligned to align (power of two), nullptr if they do not fit into the buffer
+    // (chained arena: if upstream fails)
+    char* allocate_aligned(std::size_t n, std::size_t align) noexcept;
+
     static constexpr std::size_t size()
     {
         return N;
     }
 
+    // bytes carved so far, upstream blocks included
     std::size_t used() const
     {
-        return static_cast<std::size_t>(ptr_ - buf_);
+        return used(chained());
     }
 
     void reset()
     {
+        release(chained());
         ptr_ = buf_;
+        clear_free_lists();
+    }
+
+private:
+    void init(std::false_type) noexcept {}
+
+    void init(std::true_type) noexcept
+    {
+        init(upstream_type::instance(), 0);
     }
 };
 
-template <std::size_t N>
+template <std::size_t N, std::size_t nof_classes, class Upstream>
+void
+arena<N, nof_classes, Upstream>::init(upstream_type& up, std::size_t first_block) noexcept
+{
+    std::size_t size = 2*header;
+    while (size < (first_block ? first_block : 2*N))
+        size *= 2;
+    this->up_ = &up;
+    this->blocks_ = nullptr;
+    this->end_ = buf_ + N;
+    this->first_ = size;
+    this->next_ = size;
+    this->used_ = 0;
+}
+
+// block for at least n bytes, the rest of the current one is left unused
+template <std::size_t N, std::size_t nof_classes, class Upstream>
+void
+arena<N, nof_classes, Upstream>::grow(std::size_t n)
+{
+    std::size_t size = this->next_;
+    while (size - header < n)
+        size *= 2;
+    char* p = this->up_->allocate(size);
+    block* b = reinterpret_cast<block*>(p);
+    b->next_ = this->blocks_;
+    b->size_ = size;
+    this->used_ += static_cast<std::size_t>(ptr_ - begin(chained()));
+    this->blocks_ = p;
+    this->end_ = p + size;
+    this->next_ = 2*size;
+    ptr_ = p + header;
+}
+
+template <std::size_t N, std::size_t nof_classes, class Upstream>
+void
+arena<N, nof_classes, Upstream>::release(std::true_type) noexcept
+{
+    while (this->blocks_ != nullptr)
+    {
+        block* b = reinterpret_cast<block*>(this->blocks_);
+        this->blocks_ = b->next_;
+        this->up_->deallocate(reinterpret_cast<char*>(b), b->size_);
+    }
+    this->end_ = buf_ + N;
+    this->next_ = this->first_;
+    this->used_ = 0;
+}
+
+template <std::size_t N, std::size_t nof_classes, class Upstream>
 char*
-arena<N>::allocate(std::size_t n)
+arena<N, nof_classes, Upstream>::allocate(std::size_t n)
 {
-    assert(pointer_in_buffer(ptr_) && "short_alloc has outlived arena");
-    if (buf_ + N - ptr_ >= n)
+    assert(valid() && "short_alloc has outlived arena");
+    n = round_up(n);
+    if (n != 0 && n <= max_recycled && free_[n/alignment - 1] != nullptr)
+    {
+        char* r = free_[n/alignment - 1];
+        free_[n/alignment - 1] = *reinterpret_cast<char**>(r);
+        return r;
+    }
+    if (static_cast<std::size_t>(limit(chained()) - ptr_) >= n)
     {
         char* r = ptr_;
         ptr_ += n;
         return r;
     }
-    return static_cast<char*>(::operator new(n));
+    return spill(n, chained());
+}
+
+template <std::size_t N, std::size_t nof_classes, class Upstream>
+char*
+arena<N, nof_classes, Upstream>::allocate_aligned(std::size_t n, std::size_t align) noexcept
+{
+    assert(valid() && "short_alloc has outlived arena");
+    for (bool grown = false; ; grown = true)
+    {
+        std::size_t pad = (align - reinterpret_cast<std::uintptr_t>(ptr_) % align) % align;
+        std::size_t room = static_cast<std::size_t>(limit(chained()) - ptr_);
+        if (room >= pad && room - pad >= n)
+        {
+            char* r = ptr_ + pad;
+            ptr_ = r + n;
+            return r;
+        }
+        if (grown || !try_grow(n + align, chained()))
+            return nullptr;
+    }
 }
 
-template <std::size_t N>
+// chained arena owns everything, blocks which are neither last nor recycled wait for reset()
+template <std::size_t N, std::size_t nof_classes, class Upstream>
 void
-arena<N>::deallocate(char* p, std::size_t n) noexcept
+arena<N, nof_classes, Upstream>::deallocate(char* p, std::size_t n) noexcept
 {
-    assert(pointer_in_buffer(ptr_) && "short_alloc has outlived arena");
-    if (pointer_in_buffer(p))
+    assert(valid() && "short_alloc has outlived arena");
+    if (chained::value || pointer_in_buffer(p))
     {
+        n = round_up(n);
         if (p + n == ptr_)
             ptr_ = p;
+        else if (n != 0 && n <= max_recycled)
+        {
+            *reinterpret_cast<char**>(p) = free_[n/alignment - 1];
+            free_[n/alignment - 1] = p;
+        }
     }
     else
         ::operator delete(p);
 }
 
-template <class T, std::size_t N>
+template <class T, std::size_t N, std::size_t nof_classes = 0, class Upstream = void>
 class short_alloc
 {
-    arena<N>& a_;
+    arena<N, nof_classes, Upstream>& a_;
 public:
     typedef T value_type;
 
 public:
     template <class _Up> struct rebind
     {
-        typedef short_alloc<_Up, N> other;
+        typedef short_alloc<_Up, N, nof_classes, Upstream> other;
     };
 
-    short_alloc(arena<N>& a) noexcept : a_(a)
+    short_alloc(arena<N, nof_classes, Upstream>& a) noexcept : a_(a)
     {
     }
-    template <class U> short_alloc(const short_alloc<U, N>& a) noexcept : a_(a.a_)
+    template <class U> short_alloc(const short_alloc<U, N, nof_classes, Upstream>& a) noexcept : a_(a.a_)
     {
     }
 
@@ -109,26 +360,27 @@ public:
         a_.deallocate(reinterpret_cast<char*>(p), n*sizeof(T));
     }
 
-    template <class T1, std::size_t N1, class U, std::size_t M>
+    template <class T1, std::size_t N1, std::size_t C1, class U1, class U, std::size_t M, std::size_t C2, class U2>
     friend
     bool
-    operator==(const short_alloc<T1, N1>& x, const short_alloc<U, M>& y) noexcept;
+    operator==(const short_alloc<T1, N1, C1, U1>& x, const short_alloc<U, M, C2, U2>& y) noexcept;
 
-    template <class U, std::size_t M> friend class short_alloc;
+    template <class U, std::size_t M, std::size_t C, class V> friend class short_alloc;
 };
 
-template <class T, std::size_t N, class U, std::size_t M>
+template <class T, std::size_t N, std::size_t C1, class U1, class U, std::size_t M, std::size_t C2, class U2>
 inline
 bool
-operator==(const short_alloc<T, N>& x, const short_alloc<U, M>& y) noexcept
+operator==(const short_alloc<T, N, C1, U1>& x, const short_alloc<U, M, C2, U2>& y) noexcept
 {
-    return N == M && &x.a_ == &y.a_;
+    return N == M && C1 == C2 && std::is_same<U1, U2>::value &&
+           static_cast<const void*>(&x.a_) == static_cast<const void*>(&y.a_);
 }
 
-template <class T, std::size_t N, class U, std::size_t M>
+template <class T, std::size_t N, std::size_t C1, class U1, class U, std::size_t M, std::size_t C2, class U2>
 inline
 bool
-operator!=(const short_alloc<T, N>& x, const short_alloc<U, M>& y) noexcept
+operator!=(const short_alloc<T, N, C1, U1>& x, const short_alloc<U, M, C2, U2>& y) noexcept
 {
     return !(x == y);
 }